@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+# Copyright 2018 Justin Hu
+#
+# This file is part of the SM213 assembler.
+#
+# The SM213 assembler is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or (at your
+# option) any later version.
+#
+# The SM213 assembler is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+# Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+# Assembles generated inputs that have been slow or memory hungry before, and
+# fails if any of them takes longer or more memory than its budget, or if the
+# time or memory they take grows faster than the input does. Usage:
+#   scaling-check.py <assembler>
+# Budgets are for a debug build. Needs nothing but python3 on Linux.
+
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# Each input is assembled at n, 2n, and 4n, and the time and memory taken, less
+# what an empty program takes, are fitted to c * size^k. k is 1 for linear
+# growth and 2 for quadratic - anything over this fails.
+MAX_EXPONENT = 1.3
+# times to run each size, keeping the least, as other load only adds to it
+REPEATS = 3
+
+
+def long_line(out, n):  # one line, n bytes long
+    out.write("ld $1, r0 # ")
+    chunk = "x" * 2**20  # the line is never held whole - see measure
+    for written in range(0, n - 13, len(chunk)):
+        out.write(chunk[:n - 13 - written])
+    out.write("\n")
+
+
+def labels(out, n):
+    for i in range(n):
+        out.write("L%d:\n  .long L%d\n" % (i, i))
+
+
+def pos_regions(out, n):  # placed back to front
+    for i in range(n):
+        out.write(".pos 0x%x\n  .long %d\n" % ((n - i) * 16, i))
+
+
+def empty(out, n):
+    pass
+
+
+def high_pos(out, n):  # n words, from the last one in memory down
+    for i in range(n):
+        out.write(".pos 0x%x\n  .long %d\n" % (0xfffffff0 - i * 16, i))
+
+
+def forward_references(out, n):  # every label used before it's bound
+    for i in range(n):
+        out.write("  ld $F%d, r0\n" % i)
+    for i in range(n):
+        out.write("F%d:\n" % i)
+
+
+# what's generated, n, and the seconds and MB allowed at 4n
+CASES = [
+    ("line of 25 MB to 100 MB", long_line, 25 * 10**6, 0.6, 150),
+    ("2.5*10^5 to 10^6 labels", labels, 25 * 10**4, 8.5, 540),
+    ("10^5 to 4*10^5 .pos", pos_regions, 10**5, 2.0, 190),
+    ("10^5 to 4*10^5 .pos from 0xfffffff0", high_pos, 10**5, 2.0, 190),
+    ("2.5*10^5 to 10^6 forward refs", forward_references, 25 * 10**4, 9.5,
+     660),
+]
+
+
+# Runs the assembler on source, returning the wall and CPU seconds it took and
+# its peak RSS in MB. The child's peak counts this process's own up to when it
+# was started, so inputs are generated a little at a time.
+def measure(assembler, source, image):
+    start = time.monotonic()
+    child = subprocess.Popen([assembler, "-o", image, source],
+                             stdout=subprocess.DEVNULL,
+                             stderr=subprocess.PIPE)
+    stderr = child.stderr.read()
+    _, status, usage = os.wait4(child.pid, 0)
+    seconds = time.monotonic() - start
+    child.returncode = os.waitstatus_to_exitcode(status)
+    if child.returncode != 0:
+        raise RuntimeError("exited with %d: %s" %
+                           (child.returncode, stderr.decode().strip()))
+    cpu_seconds = usage.ru_utime + usage.ru_stime
+    return seconds, cpu_seconds, usage.ru_maxrss / 1024  # ru_maxrss is in KB
+
+
+def run(assembler, directory, generate, size):
+    source = os.path.join(directory, "scaling.s")
+    with open(source, "w") as out:
+        generate(out, size)
+    image = os.path.join(directory, "scaling.img")
+    runs = [measure(assembler, source, image) for _ in range(REPEATS)]
+    return [min(amounts) for amounts in zip(*runs)]
+
+
+# the k in c * size^k that fits amounts at sizes best, by least squares of
+# their logarithms
+def exponent(sizes, amounts):
+    xs = [math.log(size) for size in sizes]
+    ys = [math.log(max(amount, 1e-6)) for amount in amounts]
+    x_mean = sum(xs) / len(xs)
+    y_mean = sum(ys) / len(ys)
+    return (sum((x - x_mean) * (y - y_mean) for x, y in zip(xs, ys)) /
+            sum((x - x_mean)**2 for x in xs))
+
+
+def check(assembler, directory, case, baseline):
+    name, generate, size, seconds_budget, mb_budget = case
+    sizes = [size, 2 * size, 4 * size]
+    results = [run(assembler, directory, generate, n) for n in sizes]
+    seconds, _, mb = results[-1]
+    # CPU time, as it's less noisy than wall time on a busy machine
+    time_exponent = exponent(
+        sizes, [result[1] - baseline[1] for result in results])
+    memory_exponent = exponent(
+        sizes, [result[2] - baseline[2] for result in results])
+    print("%-36s %6.2f s %5.0f MB  growth: time^%.2f memory^%.2f" %
+          (name, seconds, mb, time_exponent, memory_exponent))
+
+    failures = []
+    if seconds > seconds_budget:
+        failures.append("took %.2f s, over %.1f s" % (seconds, seconds_budget))
+    if mb > mb_budget:
+        failures.append("used %.0f MB, over %d MB" % (mb, mb_budget))
+    if time_exponent > MAX_EXPONENT:
+        failures.append("time grew as size^%.2f" % time_exponent)
+    if memory_exponent > MAX_EXPONENT:
+        failures.append("memory grew as size^%.2f" % memory_exponent)
+    return ["%s: %s" % (name, failure) for failure in failures]
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: scaling-check.py <assembler>")
+    assembler = os.path.abspath(sys.argv[1])
+    failures = []
+    with tempfile.TemporaryDirectory() as directory:
+        try:
+            baseline = run(assembler, directory, empty, 0)
+        except RuntimeError as error:
+            sys.exit("empty program: %s" % error)
+        for case in CASES:
+            try:
+                failures += check(assembler, directory, case, baseline)
+            except RuntimeError as error:
+                failures.append("%s: %s" % (case[0], error))
+    for failure in failures:
+        print("FAILED " + failure, file=sys.stderr)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,393 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "analysis.h"
+#include "instructions.h"
+#include "io.h"
+#include "util.h"
+
+#include <iomanip>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace sm213assemble::analysis {
+namespace {
+using sm213assemble::io::Token;
+using sm213assemble::io::tokenize;
+using sm213assemble::model::decode;
+using sm213assemble::model::Fields;
+using sm213assemble::model::fieldsOf;
+using sm213assemble::model::formOf;
+using sm213assemble::model::INSTRUCTION_FORMS;
+using sm213assemble::model::instructionSize;
+using sm213assemble::model::isInstruction;
+using sm213assemble::model::LabelUse;
+using sm213assemble::model::layout;
+using sm213assemble::model::OperandKind;
+using sm213assemble::model::ParseError;
+using sm213assemble::util::hexify;
+using std::invalid_argument;
+using std::left;
+using std::optional;
+using std::out_of_range;
+using std::right;
+using std::setw;
+using std::stoul;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+// an instruction where the program's layout puts it
+struct Placed {
+  uint32_t pos;
+  const InstructionForm* form;
+  Fields fields;                    // value is a placeholder if it uses a label
+  optional<uint32_t> labelAddress;  // plus the addend, if it uses a label
+  uint32_t lineNo;
+};
+
+// how control leaves an instruction
+enum class Flow {
+  NEXT,      // falls through
+  BRANCH,    // to its target, or falls through
+  JUMP,      // to its target
+  INDIRECT,  // somewhere only known at runtime
+  HALT,      // nowhere
+};
+
+Flow flowOf(const InstructionForm& form) noexcept {
+  const auto& mnemonic = form.mnemonic;
+  if (mnemonic == "br") return Flow::JUMP;
+  if (mnemonic == "beq" || mnemonic == "bgt") return Flow::BRANCH;
+  if (mnemonic == "halt") return Flow::HALT;
+  if (mnemonic == "j")
+    return form.operands[0].kind == OperandKind::TARGET ? Flow::JUMP
+                                                        : Flow::INDIRECT;
+  return Flow::NEXT;
+}
+
+unsigned loadsOf(const InstructionForm& form) noexcept {
+  const auto& mnemonic = form.mnemonic;
+  OperandKind kind = form.operands[0].kind;
+  if (mnemonic == "ld") return kind == OperandKind::IMMEDIATE ? 0 : 1;
+  if (mnemonic == "j")
+    return kind == OperandKind::INDIRECT_MEMORY ||
+                   kind == OperandKind::INDIRECT_INDEXED
+               ? 1
+               : 0;
+  return 0;
+}
+unsigned storesOf(const InstructionForm& form) noexcept {
+  return form.mnemonic == "st" ? 1 : 0;
+}
+
+uint32_t endOf(const Placed& instruction) noexcept {
+  return instruction.pos +
+         static_cast<uint32_t>(instructionSize(*instruction.form));
+}
+
+// where a branch or direct jump goes
+optional<uint32_t> targetOf(const Placed& instruction) {
+  Flow flow = flowOf(*instruction.form);
+  if (flow != Flow::BRANCH && flow != Flow::JUMP) return {};
+  if (instruction.labelAddress) return instruction.labelAddress;
+  if (instruction.form->value.pcRelative)
+    return endOf(instruction) +
+           static_cast<uint32_t>(
+               2 * static_cast<int8_t>(instruction.fields.value & 0xff));
+  return instruction.fields.value;
+}
+
+struct Row {
+  string name;
+  unsigned long instructions;
+  unsigned long loads;
+  unsigned long stores;
+  unsigned long cycles;
+};
+
+void printRow(ostream& out, const Row& row) {
+  out << left << setw(24) << row.name << right << setw(10)
+      << row.instructions << setw(8) << row.loads << setw(8) << row.stores
+      << setw(10) << row.cycles << '\n';
+}
+
+// Lays out the program, listing its instructions in source order, the first
+// label at each position, and the addresses of labels used as .long values.
+void list(const Program& program, vector<Placed>& instructions,
+          unordered_map<uint32_t, string_view>& labelAt,
+          vector<uint32_t>& dataLabels) {
+  vector<uint64_t> starts = layout(program);
+  vector<uint32_t> symbolPos(program.symbols.size(), 0);
+  unordered_map<string_view, uint32_t> symbolOf;
+  symbolOf.reserve(program.symbols.size());
+  for (size_t symbol = 0; symbol < program.symbols.size(); symbol++)
+    symbolOf.emplace(program.symbols[symbol], symbol);
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    if (program.ops[idx] != Program::LABEL) continue;
+    string_view name = program.symbols[program.values[idx]];
+    uint32_t pos = static_cast<uint32_t>(starts[idx]);
+    symbolPos[program.values[idx]] = pos;
+    auto inserted = labelAt.emplace(pos, name);
+    if (name < inserted.first->second)  // as if sorted by name
+      inserted.first->second = name;
+  }
+  auto labelAddress = [&](const LabelUse& use) -> optional<uint32_t> {
+    auto found = symbolOf.find(use.labelName);
+    if (found == symbolOf.end()) return {};
+    return symbolPos[found->second] + use.addend;
+  };
+
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    uint8_t op = program.ops[idx];
+    uint32_t pos = static_cast<uint32_t>(starts[idx]);
+    bool isSymbolic = (op & Program::SYMBOLIC) != 0;
+    if (isInstruction(program, idx)) {
+      Placed instruction{pos, &formOf(program, idx), fieldsOf(program, idx),
+                         {}, program.lines[idx]};
+      if (isSymbolic) {
+        const auto& use = program.symbolUses[program.values[idx]];
+        instruction.labelAddress = symbolPos[use.symbol] + use.addend;
+      }
+      instructions.push_back(instruction);
+    } else if (op == (Program::LONG | Program::SYMBOLIC)) {
+      dataLabels.push_back(
+          symbolPos[program.symbolUses[program.values[idx]].symbol]);
+    } else if (op == Program::BYTES) {
+      const Program::Chunk& chunk = program.chunks[program.values[idx]];
+      auto use = chunk.uses.begin();
+      for (const Program::ChunkInstruction& in : chunk.instructions) {
+        const InstructionForm& form = INSTRUCTION_FORMS[in.op];
+        uint32_t end = in.offset + static_cast<uint32_t>(instructionSize(form));
+        Placed instruction{pos + in.offset, &form,
+                           decode(form, chunk.bytes.data() + in.offset), {},
+                           in.line};
+        for (; use != chunk.uses.end() && use->useLocn < end; ++use) {
+          if (use->useLocn >= in.offset)
+            instruction.labelAddress = labelAddress(*use);
+          else if (optional<uint32_t> address = labelAddress(*use))
+            dataLabels.push_back(*address - use->addend);
+        }
+        instructions.push_back(instruction);
+      }
+      for (; use != chunk.uses.end(); ++use)
+        if (optional<uint32_t> address = labelAddress(*use))
+          dataLabels.push_back(*address - use->addend);
+    }
+  }
+}
+}  // namespace
+
+CycleModel::CycleModel() noexcept : defaultCycles{1}, memoryCycles{1} {}
+unsigned long CycleModel::cost(const InstructionForm& form) const noexcept {
+  auto found = cycles.find(form.mnemonic);
+  return (found == cycles.end() ? defaultCycles : found->second) +
+         memoryCycles * (loadsOf(form) + storesOf(form));
+}
+
+CycleModel readCycleModel(istream& in) {
+  CycleModel model;
+  vector<Token> tokens = tokenize(in);
+  for (auto iter = tokens.cbegin(); iter != tokens.cend(); ++iter) {
+    if (iter->value == "\n") continue;
+
+    const auto name = iter;
+    if (++iter == tokens.cend() || iter->value == "\n")
+      throw ParseError(name->lineNo, name->charNo,
+                       "expected cycle count after '" + name->value + "'.");
+    unsigned long count = 0;
+    size_t eidx = 0;
+    try {
+      count = stoul(iter->value, &eidx, 0);
+    } catch (const invalid_argument&) {
+      eidx = 0;
+    } catch (const out_of_range&) {
+      eidx = 0;
+    }
+    if (eidx != iter->value.length())
+      throw ParseError(iter->lineNo, iter->charNo,
+                       "expected cycle count, but got '" + iter->value + "'.");
+    if (iter + 1 != tokens.cend() && (++iter)->value != "\n")
+      throw ParseError(iter->lineNo, iter->charNo,
+                       "expected newline, but got '" + iter->value + "'.");
+
+    if (name->value == "default")
+      model.defaultCycles = count;
+    else if (name->value == "memory")
+      model.memoryCycles = count;
+    else
+      model.cycles[name->value] = count;
+  }
+  return model;
+}
+
+void analyze(const Program& program, const CycleModel& model, ostream& out) {
+  vector<Placed> instructions;
+  unordered_map<uint32_t, string_view> labelAt;
+  vector<uint32_t> dataLabels;
+  list(program, instructions, labelAt, dataLabels);
+  size_t count = instructions.size();
+
+  unordered_map<uint32_t, size_t> instructionAt;
+  instructionAt.reserve(count);
+  for (size_t idx = 0; idx < count; idx++)
+    instructionAt[instructions[idx].pos] = idx;  // later blocks overwrite
+
+  // instructions are only ever reached from the previous one if they follow
+  // it in both the source and memory
+  auto follows = [&instructions](size_t idx) {
+    return idx > 0 && endOf(instructions[idx - 1]) == instructions[idx].pos;
+  };
+
+  // find leaders, then split into blocks
+  vector<optional<uint32_t>> targets(count);
+  vector<bool> leader(count, false);
+  for (size_t idx = 0; idx < count; idx++) {
+    const Placed& instruction = instructions[idx];
+    if (!follows(idx) || labelAt.count(instruction.pos) != 0 ||
+        flowOf(*instructions[idx - 1].form) != Flow::NEXT)
+      leader[idx] = true;
+    targets[idx] = targetOf(instruction);
+    if (targets[idx]) {
+      auto found = instructionAt.find(*targets[idx]);
+      if (found != instructionAt.end()) leader[found->second] = true;
+    }
+  }
+
+  vector<size_t> blockStarts;
+  vector<size_t> blockOf(count);
+  for (size_t idx = 0; idx < count; idx++) {
+    if (leader[idx]) blockStarts.push_back(idx);
+    blockOf[idx] = blockStarts.size() - 1;
+  }
+  size_t blockCount = blockStarts.size();
+  auto blockEnd = [&](size_t block) {
+    return block + 1 < blockCount ? blockStarts[block + 1] : count;
+  };
+
+  vector<vector<size_t>> successors(blockCount);
+  bool hasIndirect = false;
+  for (size_t block = 0; block < blockCount; block++) {
+    size_t last = blockEnd(block) - 1;
+    Flow flow = flowOf(*instructions[last].form);
+    if ((flow == Flow::NEXT || flow == Flow::BRANCH) && last + 1 < count &&
+        follows(last + 1))
+      successors[block].push_back(blockOf[last + 1]);
+    if (targets[last]) {
+      auto found = instructionAt.find(*targets[last]);
+      if (found != instructionAt.end())
+        successors[block].push_back(blockOf[found->second]);
+    }
+    hasIndirect = hasIndirect || flow == Flow::INDIRECT;
+  }
+
+  // Reachable from the first instruction, from return addresses saved by gpc,
+  // and, if anything jumps indirectly, from any label whose address is taken.
+  vector<size_t> stack;
+  auto root = [&](uint32_t pos) {
+    auto found = instructionAt.find(pos);
+    if (found != instructionAt.end()) stack.push_back(blockOf[found->second]);
+  };
+  if (count != 0) stack.push_back(0);
+  for (const Placed& instruction : instructions) {
+    if (instruction.form->mnemonic == "gpc")
+      root(endOf(instruction) + 2 * instruction.fields.value);
+    if (hasIndirect && instruction.labelAddress &&
+        instruction.form->mnemonic == "ld")
+      root(*instruction.labelAddress);
+  }
+  if (hasIndirect)
+    for (uint32_t address : dataLabels) root(address);
+
+  vector<bool> reachable(blockCount, false);
+  while (!stack.empty()) {
+    size_t block = stack.back();
+    stack.pop_back();
+    if (reachable[block]) continue;
+    reachable[block] = true;
+    for (size_t successor : successors[block])
+      if (!reachable[successor]) stack.push_back(successor);
+  }
+
+  // per label summary
+  out << left << setw(24) << "label" << right << setw(10) << "instrs"
+      << setw(8) << "loads" << setw(8) << "stores" << setw(10) << "cycles"
+      << '\n';
+  Row total{"total", 0, 0, 0, 0};
+  Row row{"", 0, 0, 0, 0};
+  for (size_t idx = 0; idx < count; idx++) {
+    const Placed& instruction = instructions[idx];
+    auto label = labelAt.find(instruction.pos);
+    if (label != labelAt.end() || !follows(idx)) {
+      if (idx != 0) printRow(out, row);
+      row = Row{label != labelAt.end() ? string(label->second)
+                                       : hexify(instruction.pos),
+                0, 0, 0, 0};
+    }
+    for (Row* r : {&row, &total}) {
+      r->instructions++;
+      r->loads += loadsOf(*instruction.form);
+      r->stores += storesOf(*instruction.form);
+      r->cycles += model.cost(*instruction.form);
+    }
+  }
+  if (count != 0) printRow(out, row);
+  printRow(out, total);
+
+  // control flow graph
+  out << '\n';
+  for (size_t block = 0; block < blockCount; block++) {
+    const Placed& first = instructions[blockStarts[block]];
+    const Placed& last = instructions[blockEnd(block) - 1];
+    out << "block " << hexify(first.pos) << " to " << hexify(endOf(last))
+        << " (lines " << first.lineNo << '-' << last.lineNo << ")";
+    switch (flowOf(*last.form)) {
+      case Flow::INDIRECT:
+        out << " -> indirect";
+        break;
+      case Flow::HALT:
+        out << " -> halt";
+        break;
+      default:
+        break;
+    }
+    for (size_t successor : successors[block])
+      out << " -> " << hexify(instructions[blockStarts[successor]].pos);
+    out << '\n';
+  }
+
+  // unreachable code, with adjacent blocks merged
+  out << '\n';
+  bool anyUnreachable = false;
+  for (size_t block = 0; block < blockCount; block++) {
+    if (reachable[block]) continue;
+    size_t end = block;
+    while (end + 1 < blockCount && !reachable[end + 1] &&
+           follows(blockStarts[end + 1]))
+      end++;
+    const Placed& first = instructions[blockStarts[block]];
+    const Placed& last = instructions[blockEnd(end) - 1];
+    out << "unreachable " << hexify(first.pos) << " to "
+        << hexify(endOf(last)) << " (lines " << first.lineNo << '-'
+        << last.lineNo << ")\n";
+    anyUnreachable = true;
+    block = end;
+  }
+  if (!anyUnreachable) out << "no unreachable code\n";
+}
+}  // namespace sm213assemble::analysis
\ No newline at end of file
@@ -0,0 +1,63 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef SM213ASSEMBLE_ANALYSIS_H_
+#define SM213ASSEMBLE_ANALYSIS_H_
+
+#include "generator.h"
+
+#include <functional>
+#include <istream>
+#include <map>
+#include <ostream>
+
+namespace sm213assemble::analysis {
+namespace {
+using sm213assemble::model::InstructionForm;
+using sm213assemble::model::Program;
+using std::istream;
+using std::less;
+using std::map;
+using std::ostream;
+using std::string;
+}  // namespace
+
+// Static cost of each instruction: its mnemonic's entry in cycles (or
+// defaultCycles), plus memoryCycles for each memory access it makes.
+struct CycleModel {
+  map<string, unsigned long, less<>> cycles;
+  unsigned long defaultCycles;
+  unsigned long memoryCycles;
+
+  CycleModel() noexcept;
+
+  unsigned long cost(const InstructionForm&) const noexcept;
+};
+
+// Reads a cycle model - one '<mnemonic> <cycles>' pair per line, where the
+// mnemonics 'default' and 'memory' set defaultCycles and memoryCycles.
+CycleModel readCycleModel(istream&);
+
+// Splits the program into basic blocks, and reports, per label, instruction
+// counts, memory accesses, and estimated cycles, followed by the control flow
+// graph and any code that can't be reached. Works from the program's layout,
+// without placing it, so it runs in time linear in the number of statements,
+// however far apart they're placed.
+void analyze(const Program&, const CycleModel&, ostream&);
+}  // namespace sm213assemble::analysis
+
+#endif  // SM213ASSEMBLE_ANALYSIS_H_
\ No newline at end of file
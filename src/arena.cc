@@ -0,0 +1,108 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+namespace sm213assemble::util {
+namespace {
+using std::align;
+using std::bad_alloc;
+using std::free;
+using std::get_new_handler;
+using std::malloc;
+using std::max;
+using std::new_handler;
+
+size_t heapAllocationCount = 0;
+
+void* allocate(size_t count) {
+  heapAllocationCount++;
+  void* allocated;
+  while ((allocated = malloc(count == 0 ? 1 : count)) == nullptr) {
+    new_handler handler = get_new_handler();
+    if (handler == nullptr) throw bad_alloc();
+    handler();
+  }
+  return allocated;
+}
+void release(void* allocated) noexcept { free(allocated); }
+}  // namespace
+
+Arena::Arena(size_t size) noexcept
+    : blockSize{size}, current{0}, used{0}, allocationCount{0}, byteCount{0} {}
+Arena::~Arena() noexcept {
+  for (const Block& block : heldBlocks) ::operator delete(block.data);
+}
+
+void Arena::reset() noexcept {
+  current = used = 0;
+  allocationCount = byteCount = 0;
+}
+
+size_t Arena::allocations() const noexcept { return allocationCount; }
+size_t Arena::bytes() const noexcept { return byteCount; }
+size_t Arena::blocks() const noexcept { return heldBlocks.size(); }
+
+void* Arena::do_allocate(size_t count, size_t alignment) {
+  while (true) {
+    if (current < heldBlocks.size()) {
+      const Block& block = heldBlocks[current];
+      void* next = static_cast<char*>(block.data) + used;
+      size_t space = block.size - used;
+      if (align(alignment, count, next, space) != nullptr) {
+        used = block.size - space + count;
+        allocationCount++;
+        byteCount += count;
+        return next;
+      }
+      if (current + 1 < heldBlocks.size()) {  // too small - try the next one
+        current++;
+        used = 0;
+        continue;
+      }
+    }
+
+    size_t size = heldBlocks.empty() ? blockSize : 2 * heldBlocks.back().size;
+    size = max(size, count + alignment);
+    heldBlocks.push_back(Block{::operator new(size), size});
+    current = heldBlocks.size() - 1;
+    used = 0;
+  }
+}
+void Arena::do_deallocate(void*, size_t, size_t) noexcept {}
+bool Arena::do_is_equal(const memory_resource& other) const noexcept {
+  return this == &other;
+}
+
+size_t heapAllocations() noexcept { return heapAllocationCount; }
+}  // namespace sm213assemble::util
+
+// array, nothrow, and sized forms all come back to these
+void* operator new(size_t count) {
+  return sm213assemble::util::allocate(count);
+}
+void operator delete(void* allocated) noexcept {
+  sm213assemble::util::release(allocated);
+}
+void operator delete(void* allocated, size_t) noexcept {
+  sm213assemble::util::release(allocated);
+}
\ No newline at end of file
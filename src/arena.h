@@ -0,0 +1,76 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef SM213ASSEMBLE_UTIL_ARENA_H_
+#define SM213ASSEMBLE_UTIL_ARENA_H_
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+namespace sm213assemble::util {
+namespace {
+using std::pmr::memory_resource;
+using std::vector;
+}  // namespace
+
+// Memory for a parsed program, handed out in order from big blocks. Nothing is
+// freed until reset, which frees it all in constant time and keeps the blocks
+// for the next program - so once the blocks are big enough, later programs
+// take nothing more from the heap. Only the program comes from here - tokens,
+// the label tables used while parsing, and the image don't, which is why
+// heapAllocations counts those separately.
+class Arena : public memory_resource {
+ public:
+  explicit Arena(size_t blockSize = 1 << 16) noexcept;
+  Arena(const Arena&) = delete;
+  ~Arena() noexcept override;
+
+  Arena& operator=(const Arena&) = delete;
+
+  void reset() noexcept;
+
+  // since the last reset
+  size_t allocations() const noexcept;
+  size_t bytes() const noexcept;
+  // taken from the heap, ever
+  size_t blocks() const noexcept;
+
+ private:
+  struct Block {
+    void* data;
+    size_t size;
+  };
+
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void*, size_t, size_t) noexcept override;
+  bool do_is_equal(const memory_resource& other) const noexcept override;
+
+  size_t blockSize;  // of the first block - each one after is twice as big
+  vector<Block> heldBlocks;
+  size_t current;  // block being handed out from
+  size_t used;     // of the current block
+  size_t allocationCount;
+  size_t byteCount;
+};
+
+// Allocations taken from the heap by anything, arenas included, since the
+// program started. Global operator new is replaced to count them.
+size_t heapAllocations() noexcept;
+}  // namespace sm213assemble::util
+
+#endif  // SM213ASSEMBLE_UTIL_ARENA_H_
\ No newline at end of file
@@ -0,0 +1,127 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+// Compile-time checks that embed.h assembles programs to the same bytes
+// generateBinary does. Nothing here runs - the build fails if they don't
+// match.
+
+#include "embed.h"
+
+namespace sm213assemble::embed {
+namespace {
+template <size_t N, size_t M>
+constexpr bool matches(const array<uint8_t, N>& image,
+                       const uint8_t (&expected)[M]) {
+  if (N != M) return false;
+  for (size_t idx = 0; idx < N; idx++)
+    if (image[idx] != expected[idx]) return false;
+  return true;
+}
+
+// every instruction form, with labels before and after their uses
+constexpr auto INSTRUCTIONS = SM213_ASSEMBLE(
+    "start:\n"
+    "  ld $0x12345678, r1\n"
+    "  ld $end, r2\n"
+    "  ld 8(r1), r3\n"
+    "  ld (r1), r3\n"
+    "  ld (r1, r2, 4), r4\n"
+    "  st r4, 0x3c(r5)\n"
+    "  st r4, (r5, r6, 4)\n"
+    "  mov r1, r2\n"
+    "  add r3, r4\n"
+    "  and r5, r6\n"
+    "  inc r7\n"
+    "  inca r0\n"
+    "  dec r1\n"
+    "  deca r2\n"
+    "  not r3\n"
+    "  gpc $6, r6\n"
+    "  shl $3, r1\n"
+    "  shr $0x80, r2\n"
+    "  br end\n"
+    "  beq r1, start\n"
+    "  bgt r2, end\n"
+    "  j end\n"
+    "  j 0x1fe(r3)\n"
+    "  j *0x3fc(r4)\n"
+    "  j *(r5, r6, 4)  # comment\n"
+    "  nop\n"
+    "end:\n"
+    "  halt\n");
+constexpr uint8_t INSTRUCTIONS_IMAGE[] = {
+    0x01, 0x00, 0x12, 0x34, 0x56, 0x78, 0x02, 0x00, 0x00, 0x00, 0x00, 0x40,
+    0x12, 0x13, 0x10, 0x13, 0x21, 0x24, 0x34, 0xf5, 0x44, 0x56, 0x60, 0x12,
+    0x61, 0x34, 0x62, 0x56, 0x63, 0x07, 0x64, 0x00, 0x65, 0x01, 0x66, 0x02,
+    0x67, 0x03, 0x6f, 0x36, 0x71, 0x03, 0x72, 0x80, 0x80, 0x09, 0x91, 0xe8,
+    0xa2, 0x07, 0xb0, 0x00, 0x00, 0x00, 0x00, 0x40, 0xc3, 0xff, 0xd4, 0xff,
+    0xe5, 0x60, 0xff, 0x00, 0xf0, 0x00};
+static_assert(matches(INSTRUCTIONS, INSTRUCTIONS_IMAGE),
+              "embedded instructions differ from generateBinary");
+
+// every directive
+constexpr auto DIRECTIVES = SM213_ASSEMBLE(
+    ".pos 0x10\n"
+    "a: .long a\n"
+    ".space 3\n"
+    ".fill 2, 0xab\n"
+    ".align 8\n"
+    "b: .jumptable a, b\n"
+    ".data 0xfeedf00d\n");
+constexpr uint8_t DIRECTIVES_IMAGE[] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00,
+    0x00, 0xab, 0xab, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x20, 0xfe, 0xed, 0xf0, 0x0d};
+static_assert(matches(DIRECTIVES, DIRECTIVES_IMAGE),
+              "embedded directives differ from generateBinary");
+
+// labels on lines of their own before a .jumptable name the aligned table
+constexpr auto TABLE = SM213_ASSEMBLE(
+    "nop\n"
+    "table:\n"
+    "\n"
+    "  .jumptable a, b\n"
+    "a: halt\n"
+    "b: j *(r1, r2, 4)\n"
+    "  ld $table, r0\n");
+constexpr uint8_t TABLE_IMAGE[] = {
+    0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x00,
+    0x0e, 0xf0, 0x00, 0xe1, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04};
+static_assert(matches(TABLE, TABLE_IMAGE),
+              "embedded jump table differs from generateBinary");
+
+// values split into tokens the way io.cc splits them
+constexpr auto VALUES = SM213_ASSEMBLE(
+    "a: nop\n"
+    "  br -2\n"
+    "  beq r1, a+2\n"
+    "  ld $b+4, r1\n"
+    "  ld $0x10-4, r2\n"
+    "  j b-6\n"
+    "b: .long a + 8\n"
+    "  .jumptable a+2, b - 2\n"
+    "  .space 3-1\n");
+constexpr uint8_t VALUES_IMAGE[] = {
+    0xff, 0x00, 0x80, 0xff, 0x91, 0xfe, 0x01, 0x00, 0x00, 0x00, 0x00, 0x1c,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x0c, 0xb0, 0x00, 0x00, 0x00, 0x00, 0x12,
+    0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x16,
+    0x00, 0x00};
+static_assert(matches(VALUES, VALUES_IMAGE),
+              "embedded values differ from generateBinary");
+}  // namespace
+}  // namespace sm213assemble::embed
\ No newline at end of file
@@ -0,0 +1,500 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+// Assembles SM213 programs at compile time, for C++ code that carries its own
+// programs - test harnesses, mostly. Encoding goes through INSTRUCTION_FORMS,
+// so embedded programs assemble to exactly what generateBinary makes of them.
+// Errors in a program assembled in a constant expression stop compilation at
+// the throw that describes them; at runtime, they're thrown as logic_errors.
+//
+//   constexpr auto IMAGE = SM213_ASSEMBLE("ld $1, r0\nhalt\n");
+//
+// This is a subset of the assembler: instructions, labels, comments, and the
+// directives .pos, .long (or .data), .space, .fill, .align, and .jumptable.
+// Values are numbers, negated numbers, or labels, plus or minus numbers - there
+// are no other expressions or .equ constants, and no .rept or .incbin. There
+// can be at most MAX_LABELS labels.
+// embed.cc checks what this assembles to at compile time.
+
+#ifndef SM213ASSEMBLE_EMBED_H_
+#define SM213ASSEMBLE_EMBED_H_
+
+#include "instructions.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+namespace sm213assemble::embed {
+namespace {
+using sm213assemble::model::encode;
+using sm213assemble::model::Fields;
+using sm213assemble::model::INSTRUCTION_FORMS;
+using sm213assemble::model::InstructionForm;
+using sm213assemble::model::instructionSize;
+using sm213assemble::model::MEMORY_SIZE;
+using sm213assemble::model::OperandKind;
+using sm213assemble::model::putInt;
+using sm213assemble::model::valueOffset;
+using sm213assemble::model::ValueSpec;
+using std::array;
+using std::logic_error;
+using std::size_t;
+using std::string_view;
+}  // namespace
+
+constexpr size_t MAX_LABELS = 256;
+
+namespace {
+constexpr bool isAlnum(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9');
+}
+// the characters io.cc's SPECIAL_SYMBOLS splits into tokens of their own
+constexpr bool isSpecial(char c) {
+  return c == '(' || c == ')' || c == '$' || c == ',' || c == '*' ||
+         c == '+' || c == '-' || c == '/';
+}
+constexpr bool isWordChar(char c) {
+  return isAlnum(c) || c == '_' || c == '.' || c == ':';
+}
+
+// splits source into the same tokens io::tokenize would
+class Lexer {
+ public:
+  constexpr explicit Lexer(string_view s) : source{s}, idx{0} {}
+
+  // the next token - "\n" at the end of a line, and empty at the end of source
+  constexpr string_view next() {
+    while (idx < source.size()) {
+      char c = source[idx];
+      if (c == ' ' || c == '\t' || c == '\r') {
+        idx++;
+      } else if (c == '#') {
+        while (idx < source.size() && source[idx] != '\n') idx++;
+      } else if (c == '\n' || isSpecial(c)) {
+        return source.substr(idx++, 1);
+      } else if (isWordChar(c)) {
+        size_t start = idx;
+        while (idx < source.size() && isWordChar(source[idx])) idx++;
+        return source.substr(start, idx - start);
+      } else {
+        throw logic_error("illegal character.");
+      }
+    }
+    return source.substr(idx, 0);
+  }
+  constexpr string_view peek() {
+    size_t saved = idx;
+    string_view token = next();
+    idx = saved;
+    return token;
+  }
+
+ private:
+  string_view source;
+  size_t idx;
+};
+
+constexpr bool validLabel(string_view s) {
+  if (s.empty() || (s.front() >= '0' && s.front() <= '9')) return false;
+  for (char c : s)
+    if (!isAlnum(c) && c != '_') return false;
+  return true;
+}
+constexpr bool isRegister(string_view s) {
+  return s.size() == 2 && s[0] == 'r' && s[1] >= '0' && s[1] <= '7';
+}
+constexpr bool isMnemonic(string_view s) {
+  for (const InstructionForm& form : INSTRUCTION_FORMS)
+    if (form.mnemonic == s) return true;
+  return false;
+}
+
+// reads a number the way stoul with base 0 does
+constexpr long getNumber(string_view s) {
+  unsigned base = 10;
+  if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    s.remove_prefix(2);
+  } else if (s.size() > 1 && s[0] == '0') {
+    base = 8;
+    s.remove_prefix(1);
+  }
+  if (s.empty()) throw logic_error("expected number.");
+
+  long value = 0;
+  for (char c : s) {
+    unsigned digit = base;
+    if (c >= '0' && c <= '9')
+      digit = static_cast<unsigned>(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      digit = static_cast<unsigned>(c - 'a' + 0xa);
+    else if (c >= 'A' && c <= 'F')
+      digit = static_cast<unsigned>(c - 'A' + 0xa);
+    if (digit >= base) throw logic_error("expected number.");
+    value = value * base + digit;
+    if (value > 0xffffffffff) throw logic_error("number out of range.");
+  }
+  return value;
+}
+
+// a number, or a label's address plus a number
+struct Value {
+  string_view label;  // empty if it's just a number
+  long number;
+};
+// Reads a number, a negated number, or a label, followed by any numbers added
+// or subtracted - the expressions generator.cc's getExpression reads that don't
+// need .equ, parentheses, * or /.
+constexpr Value getValue(Lexer& lexer) {
+  Value value{{}, 0};
+  string_view token = lexer.next();
+  if (validLabel(token)) {
+    value.label = token;
+  } else if (token == "-") {
+    value.number = -getNumber(lexer.next());
+  } else {
+    value.number = getNumber(token);
+  }
+  while (lexer.peek() == "+" || lexer.peek() == "-") {
+    bool subtracting = lexer.next() == "-";
+    long number = getNumber(lexer.next());
+    value.number += subtracting ? -number : number;
+  }
+  return value;
+}
+// checks that value is an unsigned number that fits in 4 bytes
+constexpr uint32_t intOf(const Value& value) {
+  if (!value.label.empty() || value.number < 0)
+    throw logic_error("expected unsigned number.");
+  if (value.number > 0xffffffff)
+    throw logic_error("number must fit in 4 bytes.");
+  return static_cast<uint32_t>(value.number);
+}
+constexpr uint32_t getInt(Lexer& lexer) { return intOf(getValue(lexer)); }
+// a literal value field, checked against its form's constraints
+constexpr uint32_t fieldValue(long value, const ValueSpec& spec) {
+  if (value % spec.scale != 0)
+    throw logic_error("value must be divisible by its scale.");
+  value /= spec.scale;
+  if (value > spec.max || value < spec.min)
+    throw logic_error("value out of range.");
+  return static_cast<uint32_t>(spec.negate ? -value : value);
+}
+
+struct Label {
+  string_view name;
+  uint32_t pos;
+};
+struct Labels {
+  array<Label, MAX_LABELS> entries;
+  size_t count;
+
+  constexpr const Label* find(string_view name) const {
+    for (size_t idx = 0; idx < count; idx++)
+      if (entries[idx].name == name) return &entries[idx];
+    return nullptr;
+  }
+};
+
+struct Operand {
+  OperandKind kind;
+  bool hasValue;
+  Value value;
+  uint8_t first;
+  uint8_t second;
+};
+
+constexpr uint8_t getRegister(string_view s) {
+  if (!isRegister(s)) throw logic_error("expected register.");
+  return static_cast<uint8_t>(s[1] - '0');
+}
+constexpr void expect(Lexer& lexer, string_view expected) {
+  if (lexer.next() != expected) throw logic_error("unexpected token.");
+}
+
+// parses one operand, as generator.cc's getOperand does
+constexpr Operand getOperand(Lexer& lexer) {
+  Operand operand{OperandKind::REGISTER, false, {{}, 0}, 0, 0};
+  string_view token = lexer.peek();
+  if (token == "$") {
+    lexer.next();
+    operand.kind = OperandKind::IMMEDIATE;
+    operand.hasValue = true;
+    operand.value = getValue(lexer);
+    return operand;
+  } else if (isRegister(token)) {
+    operand.first = getRegister(lexer.next());
+    return operand;
+  }
+
+  bool indirect = token == "*";
+  if (indirect) {
+    lexer.next();
+    token = lexer.peek();
+  }
+  if (token != "(") {
+    operand.hasValue = true;
+    operand.value = getValue(lexer);
+    if (!indirect && lexer.peek() != "(") {
+      operand.kind = OperandKind::TARGET;
+      return operand;
+    }
+  }
+  expect(lexer, "(");
+
+  operand.first = getRegister(lexer.next());
+  token = lexer.next();
+  if (token == ")") {
+    operand.kind =
+        indirect ? OperandKind::INDIRECT_MEMORY : OperandKind::MEMORY;
+    return operand;
+  }
+  if (token != "," || operand.hasValue)
+    throw logic_error("malformed memory operand.");
+  operand.second = getRegister(lexer.next());
+  expect(lexer, ",");
+  expect(lexer, "4");
+  expect(lexer, ")");
+  operand.kind =
+      indirect ? OperandKind::INDIRECT_INDEXED : OperandKind::INDEXED;
+  return operand;
+}
+
+constexpr void setRegister(Fields& fields, char field, uint8_t reg) {
+  if (field == 's') fields.s = reg;
+  if (field == 'd') fields.d = reg;
+  if (field == 'b') fields.b = reg;
+  if (field == 'i') fields.i = reg;
+}
+
+// writes count copies of value at pos, unless only sizing
+constexpr void fill(uint8_t* out, uint64_t& size, uint64_t pos, uint8_t value,
+                    uint64_t count) {
+  if (count > MEMORY_SIZE - pos) throw logic_error("past end of memory.");
+  for (uint64_t idx = 0; idx < count && out != nullptr; idx++)
+    out[pos + idx] = value;
+  if (pos + count > size) size = pos + count;
+}
+// writes count bytes at pos, unless only sizing
+constexpr void put(uint8_t* out, uint64_t& size, uint64_t pos,
+                   const uint8_t* bytes, size_t count) {
+  if (count > MEMORY_SIZE - pos) throw logic_error("past end of memory.");
+  for (size_t idx = 0; idx < count && out != nullptr; idx++)
+    out[pos + idx] = bytes[idx];
+  if (pos + count > size) size = pos + count;
+}
+
+// where label is, if it's being resolved now
+constexpr uint32_t target(const Labels& labels, string_view label,
+                          bool resolving) {
+  const Label* found = labels.find(label);
+  if (found == nullptr && resolving) throw logic_error("unbound label.");
+  return found == nullptr ? 0 : found->pos;
+}
+constexpr void putWord(uint8_t* out, uint64_t& size, uint64_t pos,
+                       uint32_t word) {
+  uint8_t bytes[4]{};
+  putInt(word, bytes);
+  put(out, size, pos, bytes, 4);
+}
+constexpr bool isLabelBinding(string_view token) {
+  return !token.empty() && token.back() == ':' &&
+         validLabel(token.substr(0, token.size() - 1));
+}
+
+// Assembles source once. The first time, out is null, and only labels and the
+// image size are worked out; the second time, bytes go to out.
+constexpr uint64_t run(string_view source, Labels& labels, uint8_t* out) {
+  Lexer lexer(source);
+  uint64_t currPos = 0;
+  uint64_t size = 0;
+  bool resolving = out != nullptr;
+  for (string_view token = lexer.next(); !token.empty();
+       token = lexer.next()) {
+    if (token == "\n") continue;
+    if (isLabelBinding(token)) {  // label binding
+      // labels before a .jumptable name the table, even on lines of their
+      // own, so it's aligned first
+      Lexer ahead = lexer;
+      string_view next = ahead.next();
+      while (isLabelBinding(next) || next == "\n") next = ahead.next();
+      if (next == ".jumptable") currPos += (4 - currPos % 4) % 4;
+
+      string_view name = token.substr(0, token.size() - 1);
+      if (currPos >= MEMORY_SIZE)
+        throw logic_error("label past end of memory.");
+      if (!resolving) {
+        if (labels.find(name) != nullptr)
+          throw logic_error("cannot reuse label.");
+        if (labels.count == MAX_LABELS) throw logic_error("too many labels.");
+        labels.entries[labels.count++] =
+            Label{name, static_cast<uint32_t>(currPos)};
+      }
+      continue;  // labels don't have to have a newline after them
+    }
+
+    if (token == ".pos") {
+      currPos = getInt(lexer);
+    } else if (token == ".long" || token == ".data") {
+      Value value = getValue(lexer);
+      uint32_t word = value.label.empty()
+                          ? intOf(value)
+                          : target(labels, value.label, resolving) +
+                                static_cast<uint32_t>(value.number);
+      putWord(out, size, currPos, word);
+      currPos += 4;
+    } else if (token == ".jumptable") {
+      currPos += (4 - currPos % 4) % 4;
+      for (bool more = true; more;) {
+        Value address = getValue(lexer);
+        if (address.label.empty()) throw logic_error("expected label.");
+        putWord(out, size, currPos,
+                target(labels, address.label, resolving) +
+                    static_cast<uint32_t>(address.number));
+        currPos += 4;
+        more = lexer.peek() == ",";
+        if (more) lexer.next();
+      }
+    } else if (token == ".space") {
+      uint64_t count = getInt(lexer);
+      fill(nullptr, size, currPos, 0, count);  // the image starts out zeroed
+      currPos += count;
+    } else if (token == ".fill") {
+      uint64_t count = getInt(lexer);
+      expect(lexer, ",");
+      uint32_t value = getInt(lexer);
+      if (value > 0xff) throw logic_error("fill value must fit in 1 byte.");
+      fill(out, size, currPos, static_cast<uint8_t>(value), count);
+      currPos += count;
+    } else if (token == ".align") {
+      uint64_t alignment = getInt(lexer);
+      if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        throw logic_error("alignment must be a power of two.");
+      currPos += (alignment - currPos % alignment) % alignment;
+      if (currPos > MEMORY_SIZE) throw logic_error("past end of memory.");
+      if (currPos > size) size = currPos;
+    } else if (isMnemonic(token)) {
+      array<Operand, 2> operands{};
+      size_t operandCount = 0;
+      if (lexer.peek() != "\n" && !lexer.peek().empty()) {
+        operands[operandCount++] = getOperand(lexer);
+        while (lexer.peek() == ",") {
+          lexer.next();
+          if (operandCount == operands.size())
+            throw logic_error("too many operands.");
+          operands[operandCount++] = getOperand(lexer);
+        }
+      }
+
+      const InstructionForm* form = nullptr;
+      for (const InstructionForm& candidate : INSTRUCTION_FORMS) {
+        bool matches = candidate.mnemonic == token &&
+                       candidate.operandCount == operandCount;
+        for (size_t idx = 0; matches && idx < operandCount; idx++)
+          matches = candidate.operands[idx].kind == operands[idx].kind;
+        if (matches && form == nullptr) form = &candidate;
+      }
+      if (form == nullptr) throw logic_error("invalid operands.");
+
+      Fields fields{0, 0, 0, 0, 0};
+      const Value* value = nullptr;  // null if a sugared offset, or no value
+      for (size_t idx = 0; idx < operandCount; idx++) {
+        const Operand& operand = operands[idx];
+        char field = form->operands[idx].field;
+        char field2 = form->operands[idx].field2;
+        switch (operand.kind) {
+          case OperandKind::REGISTER:
+            setRegister(fields, field, operand.first);
+            break;
+          case OperandKind::MEMORY:
+          case OperandKind::INDIRECT_MEMORY:
+            setRegister(fields, field2, operand.first);
+            if (operand.hasValue) value = &operand.value;
+            break;
+          case OperandKind::INDEXED:
+          case OperandKind::INDIRECT_INDEXED:
+            setRegister(fields, field, operand.first);
+            setRegister(fields, field2, operand.second);
+            break;
+          default:
+            value = &operand.value;
+            break;
+        }
+      }
+
+      size_t length = instructionSize(*form);
+      if (value != nullptr && !value->label.empty()) {
+        if (!form->value.allowLabel) throw logic_error("expected number.");
+        uint32_t to = target(labels, value->label, resolving) +
+                      static_cast<uint32_t>(value->number);
+        long diff = static_cast<long>(to) -
+                    static_cast<long>(currPos + length);  // if PC-relative
+        if (form->value.pcRelative && resolving &&
+            (diff % 2 != 0 || diff / 2 > 0x7f || diff / 2 < -0x80))
+          throw logic_error("label too far from branch, or misaligned.");
+        fields.value = form->value.pcRelative
+                           ? static_cast<uint32_t>(diff / 2)
+                           : to;
+      } else if (value != nullptr) {
+        fields.value = fieldValue(value->number, form->value);
+      }
+
+      uint8_t bytes[6] = {0, 0, 0, 0, 0, 0};
+      encode(*form, fields, bytes);
+      put(out, size, currPos, bytes, length);
+      currPos += length;
+    } else {
+      throw logic_error("unrecognized token.");
+    }
+
+    token = lexer.peek();
+    if (!token.empty() && token != "\n")
+      throw logic_error("expected newline.");
+  }
+  return size;
+}
+}  // namespace
+
+// bytes in the image of source
+constexpr size_t imageSize(string_view source) {
+  Labels labels{};
+  return run(source, labels, nullptr);
+}
+
+// Assembles source, whose image must be N bytes - see imageSize. N can be more
+// than that, in which case the rest is zeros.
+template <size_t N>
+constexpr array<uint8_t, N> assembleImage(string_view source) {
+  Labels labels{};
+  array<uint8_t, N> image{};
+  if (run(source, labels, nullptr) > N)
+    throw logic_error("image is bigger than its array.");
+  run(source, labels, image.data());
+  return image;
+}
+}  // namespace sm213assemble::embed
+
+// the image of a string literal, as a std::array sized to fit
+#define SM213_ASSEMBLE(source)                                            \
+  ::sm213assemble::embed::assembleImage<::sm213assemble::embed::imageSize( \
+      source)>(source)
+
+#endif  // SM213ASSEMBLE_EMBED_H_
\ No newline at end of file
@@ -16,130 +16,447 @@
 // the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "generator.h"
+#include "instructions.h"
 #include "util.h"
 
 #include <algorithm>
+#include <array>
+#include <cstdio>
 #include <iostream>
 #include <limits>
-#include <list>
 #include <map>
+#include <memory>
 #include <tuple>
+#include <unordered_map>
 
 namespace sm213assemble::model {
 namespace {
+using sm213assemble::io::FileOpenError;
+using sm213assemble::io::MappedFile;
+using sm213assemble::io::tokenizeLine;
 using sm213assemble::util::hexify;
 using std::all_of;
+using std::any_of;
+using std::array;
 using std::cerr;
+using std::copy;
+using std::fill_n;
 using std::find;
+using std::find_if;
 using std::get;
 using std::invalid_argument;
-using std::list;
+using std::ios_base;
+using std::make_shared;
+using std::make_unique;
 using std::map;
 using std::max;
+using std::min;
+using std::mismatch;
+using std::move;
 using std::numeric_limits;
+using std::ostream;
+using std::out_of_range;
 using std::pair;
-using std::stol;
+using std::prev;
+using std::sort;
 using std::stoul;
+using std::streamoff;
+using std::streamsize;
 using std::to_string;
 using std::tuple;
+using std::unique_ptr;
+using std::unordered_map;
 
-struct Block {
-  uint32_t startPos;
+typedef vector<Token>::const_iterator const_iter;
+// where each label was bound - only ever looked up by name
+typedef unordered_map<string, uint32_t> LabelBinds;
+
+bool validLabel(const string& s, bool expectColon = false) {
+  return all_of(s.begin(), s.end() - (expectColon ? 1 : 0),
+                [](char c) { return isalnum(c) || c == '_'; }) &&
+         !isdigit(s.front()) && (!expectColon || s.back() == ':');
+}
+
+// Records that [start, end) has been written, warning about any part of it
+// that had already been written. Extents are kept merged, so each check is a
+// logarithmic lookup rather than a scan of every earlier block.
+void claimExtent(map<uint64_t, uint64_t>& extents, uint64_t start,
+                 uint64_t end) {
+  if (start == end) return;
+
+  auto iter = extents.upper_bound(start);
+  if (iter != extents.begin() && prev(iter)->second > start) --iter;
+  while (iter != extents.end() && iter->first < end) {
+    cerr << "Warning: overwriting some bytes in block from " << std::hex
+         << iter->first << " to " << iter->second << std::dec << ".\n";
+    start = min(start, iter->first);
+    end = max(end, iter->second);
+    iter = extents.erase(iter);
+  }
+  extents.emplace(start, end);
+}
+}  // namespace
+
+LabelUse::LabelUse(uint32_t ul, string ln, uint32_t a, unsigned ll,
+                   unsigned lc, bool pcr) noexcept
+    : useLocn{ul},
+      isPCRel{pcr},
+      labelName{ln},
+      addend{a},
+      labelLine{ll},
+      labelChar{lc} {}
+
+size_t fixupSize(const LabelUse& use) noexcept { return use.isPCRel ? 1 : 4; }
+
+void resolve(const LabelUse& use, uint32_t target, uint8_t* out) {
+  target += use.addend;
+  if (use.isPCRel) {
+    long diff =
+        static_cast<long>(target) - (static_cast<long>(use.useLocn) + 1);
+    if (diff % 2 != 0)
+      throw ParseError(
+          use.labelLine, use.labelChar,
+          "Cannot have label offset not divisible by two, currently " +
+              hexify(diff) + ".");
+    diff /= 2;
+    if (diff > 0x7f || diff < -0x80)
+      throw ParseError(
+          use.labelLine, use.labelChar,
+          "use of label '" + use.labelName +
+              "' may not be more than 0x80 from its binding, currently " +
+              hexify(2 * diff) + ".");
+    out[0] = static_cast<uint8_t>(static_cast<int8_t>(diff));
+  } else {
+    putInt(target, out);
+  }
+}
+
+namespace {
+[[noreturn]] void unboundLabel(const LabelUse& use) {
+  throw ParseError(use.labelLine, use.labelChar,
+                   "unbound label '" + use.labelName + "'.");
+}
+
+// a run of a .rept body - bytes, with the label uses in them, or a fill
+struct ReptPiece {
   vector<uint8_t> bytes;
+  vector<LabelUse> uses;  // useLocn is counted from the start of bytes
+  vector<Program::ChunkInstruction> instructions;  // offset is too
+  uint64_t fillCount;                              // if bytes is empty
+  uint8_t fillValue;
 };
 
-struct LabelUse {
-  uint32_t useLocn;
-  bool isPCRel;
-  string labelName;
-  unsigned labelLine;
-  unsigned labelChar;
+// Destination for assembled bytes. Bytes are written sequentially from the
+// position given by the last setPos; label uses refer to placeholders that
+// have already been written.
+class Image {
+ public:
+  Image() noexcept = default;
+  Image(const Image&) = delete;
+  virtual ~Image() noexcept = default;
+
+  Image& operator=(const Image&) = delete;
 
-  LabelUse(uint32_t useLocn, string labelName, unsigned lineNo, unsigned charNo,
-           bool isPCRel) noexcept;
+  virtual void setPos(uint32_t pos) = 0;
+  virtual void write(const uint8_t* bytes, size_t count) = 0;
+  // writes count copies of value, without needing them all in memory
+  virtual void fill(uint8_t value, uint64_t count) = 0;
+  // writes size bytes of file from offset on, which may be kept rather than
+  // copied
+  virtual void include(const shared_ptr<const MappedFile>& file,
+                       uint64_t offset, uint64_t size);
+  // pads to the next multiple of alignment, which is padding bytes away
+  virtual void align(uint32_t alignment, uint64_t padding);
+  virtual void use(const LabelUse& use, const LabelBinds& labelBinds) = 0;
+  virtual void bind(const string& labelName, uint32_t pos) = 0;
+  // writes an instruction, or a .long, whose value may be a label
+  virtual void instruction(const Instruction& instruction,
+                           const optional<LabelUse>& use,
+                           const LabelBinds& labelBinds);
+  virtual void word(uint32_t value, const optional<LabelUse>& use,
+                    const LabelBinds& labelBinds);
+  // Writes copy number copy of a piece of a .rept body, starting at pos. Copy
+  // 0 of a piece always comes first, and the piece is the same object for
+  // every later copy.
+  virtual void repeat(const ReptPiece& piece, unsigned long copy,
+                      uint64_t pos, const LabelBinds& labelBinds);
+  // says that what comes next is from the given line of the source
+  virtual void line(unsigned lineNo);
+  // says that label b was subtracted from label a
+  virtual void subtract(const string& a, const string& b);
 };
 
-LabelUse::LabelUse(uint32_t ul, string ln, unsigned ll, unsigned lc,
-                   bool pcr) noexcept
-    : useLocn{ul}, isPCRel{pcr}, labelName{ln}, labelLine{ll}, labelChar{lc} {}
+void Image::include(const shared_ptr<const MappedFile>& file,
+                    uint64_t offset, uint64_t size) {
+  write(file->data() + offset, size);
+}
+void Image::align(uint32_t, uint64_t padding) { fill(0, padding); }
+void Image::instruction(const Instruction& instruction,
+                        const optional<LabelUse>& labelUse,
+                        const LabelBinds& labelBinds) {
+  uint8_t encoded[6];
+  encode(*instruction.form, instruction.fields, encoded);
+  write(encoded, instructionSize(*instruction.form));
+  if (labelUse) use(*labelUse, labelBinds);
+}
+void Image::word(uint32_t value, const optional<LabelUse>& labelUse,
+                 const LabelBinds& labelBinds) {
+  uint8_t bytes[4];
+  putInt(value, bytes);
+  write(bytes, 4);
+  if (labelUse) use(*labelUse, labelBinds);
+}
+void Image::repeat(const ReptPiece& piece, unsigned long, uint64_t pos,
+                   const LabelBinds& labelBinds) {
+  write(piece.bytes.data(), piece.bytes.size());
+  for (LabelUse labelUse : piece.uses) {
+    labelUse.useLocn += static_cast<uint32_t>(pos);
+    use(labelUse, labelBinds);
+  }
+}
+void Image::line(unsigned) {}
+void Image::subtract(const string&, const string&) {}
 
-typedef vector<Token>::const_iterator const_iter;
+// Holds the whole program in memory, in pages of the address space that are
+// only allocated once something is written to them (see PagedMemory). The
+// image is put together from, or written out of, the pages at the end.
+class PagedImage : public Image {
+ public:
+  PagedImage() noexcept;
 
-bool validLabel(string s, bool expectColon = false) {
-  return all_of(s.begin(), s.end() - (expectColon ? 1 : 0),
-                [](char c) { return isalnum(c) || c == '_'; }) &&
-         !isdigit(s.front()) && (!expectColon || s.back() == ':');
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+
+  vector<uint8_t> finish();
+  void finish(ostream& out, bool seekable);
+
+ private:
+  // claims what was written since the last setPos or fill
+  void endRun();
+
+  PagedMemory memory;
+  map<uint64_t, uint64_t> extents;
+  uint64_t runStart;
+  uint64_t currPos;
+  uint64_t end;  // of the image
+};
+
+PagedImage::PagedImage() noexcept : runStart{0}, currPos{0}, end{0} {}
+void PagedImage::setPos(uint32_t pos) {
+  endRun();
+  runStart = currPos = pos;
+}
+void PagedImage::write(const uint8_t* bytes, size_t count) {
+  memory.put(currPos, bytes, count);
+  currPos += count;
+}
+void PagedImage::fill(uint8_t value, uint64_t count) {
+  endRun();
+  memory.fill(currPos, value, count);
+  currPos += count;
+  endRun();
+}
+void PagedImage::use(const LabelUse& labelUse, const LabelBinds& labelBinds) {
+  auto found = labelBinds.find(labelUse.labelName);
+  if (found == labelBinds.end()) unboundLabel(labelUse);
+  uint8_t bytes[4];
+  resolve(labelUse, found->second, bytes);
+  memory.put(labelUse.useLocn, bytes, fixupSize(labelUse));
+}
+void PagedImage::bind(const string&, uint32_t) {}
+vector<uint8_t> PagedImage::finish() {
+  endRun();
+  return memory.read(end);
+}
+void PagedImage::finish(ostream& out, bool seekable) {
+  endRun();
+  memory.write(out, end, seekable);
+  if (!out) throw FileOpenError();
+}
+void PagedImage::endRun() {
+  claimExtent(extents, runStart, currPos);
+  runStart = currPos;
+  end = max(end, currPos);
 }
 
-vector<uint8_t> bytesFromBlocks(vector<Block> blocks) noexcept {
-  vector<uint8_t> result;
+// Writes the program to a file as it goes. Only the tail of the current block
+// is buffered; label uses are resolved as soon as their label is bound, and
+// once more than fixupBudget are waiting they're spilled to a temporary file
+// and resolved at the end.
+class StreamedImage : public Image {
+ public:
+  StreamedImage(ofstream& fout, size_t fixupBudget) noexcept;
+  ~StreamedImage() noexcept override;
 
-  vector<pair<uint32_t, uint32_t>> areas;
-  for (const Block& b : blocks) {  // check for collisions
-    for (const auto& p : areas) {
-      if ((p.first <= b.startPos && b.startPos < p.second) ||
-          (p.first < b.startPos + b.bytes.size() &&
-           b.startPos + b.bytes.size() <= p.second) ||
-          (p.first > b.startPos && b.startPos + b.bytes.size() >= p.second))
-        cerr << "Warning: overwriting some bytes in block from " << std::hex
-             << p.first << " to " << p.second << std::dec << ".\n";
-    }
-    areas.push_back(
-        pair<uint32_t, uint32_t>(b.startPos, b.startPos + b.bytes.size()));
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+
+  void finish(const LabelBinds& labelBinds);
+
+ private:
+  static constexpr size_t FLUSH_SIZE = 1 << 16;
+
+  void flush();
+  void patch(uint32_t locn, const uint8_t* bytes, size_t count);
+  void spill();
+
+  ofstream& fout;
+  size_t fixupBudget;
+  uint64_t blockStart;
+  uint64_t bufferStart;
+  uint64_t fileEnd;  // anything past here is a hole, and reads as zeros
+  vector<uint8_t> buffer;
+  map<uint64_t, uint64_t> extents;
+  map<string, vector<LabelUse>> unresolved;
+  size_t unresolvedCount;
+  FILE* spillFile;
+};
+
+StreamedImage::StreamedImage(ofstream& f, size_t b) noexcept
+    : fout{f},
+      fixupBudget{b},
+      blockStart{0},
+      bufferStart{0},
+      fileEnd{0},
+      unresolvedCount{0},
+      spillFile{nullptr} {}
+StreamedImage::~StreamedImage() noexcept {
+  if (spillFile != nullptr) fclose(spillFile);
+}
+void StreamedImage::setPos(uint32_t pos) {
+  flush();
+  claimExtent(extents, blockStart, bufferStart);
+  blockStart = bufferStart = pos;
+}
+void StreamedImage::write(const uint8_t* bytes, size_t count) {
+  if (count < FLUSH_SIZE) {
+    buffer.insert(buffer.end(), bytes, bytes + count);
+    if (buffer.size() >= FLUSH_SIZE) flush();
+    return;
   }
 
-  size_t maxNeeded = 0;
-  for (const Block& b : blocks) {
-    maxNeeded = max(maxNeeded, b.startPos + b.bytes.size());
+  flush();  // big enough to write from where it is, without buffering
+  fout.seekp(static_cast<streamoff>(bufferStart));
+  fout.write(reinterpret_cast<const char*>(bytes),
+             static_cast<streamsize>(count));
+  bufferStart += count;
+  fileEnd = max(fileEnd, bufferStart);
+}
+void StreamedImage::fill(uint8_t value, uint64_t count) {
+  // zeros only need writing if they cover something already in the file
+  while (count != 0 &&
+         (value != 0 || bufferStart + buffer.size() < fileEnd)) {
+    uint64_t chunk = min<uint64_t>(count, FLUSH_SIZE);
+    if (value == 0)
+      chunk = min(chunk, fileEnd - (bufferStart + buffer.size()));
+    buffer.insert(buffer.end(), chunk, value);
+    count -= chunk;
+    if (buffer.size() >= FLUSH_SIZE) flush();
   }
+  if (count == 0) return;
 
-  result.resize(maxNeeded);
+  flush();
+  bufferStart += count;
+}
+void StreamedImage::use(const LabelUse& labelUse,
+                        const LabelBinds& labelBinds) {
+  auto found = labelBinds.find(labelUse.labelName);
+  if (found != labelBinds.end()) {
+    uint8_t bytes[4];
+    resolve(labelUse, found->second, bytes);
+    patch(labelUse.useLocn, bytes, fixupSize(labelUse));
+    return;
+  }
 
-  for (const Block& b : blocks) {  // generate code, keep placeholders
-    uint32_t currPos = b.startPos;
-    for (uint8_t byte : b.bytes) {
-      result[currPos] = byte;
-      currPos++;
+  unresolved[labelUse.labelName].push_back(labelUse);
+  if (++unresolvedCount > fixupBudget) spill();
+}
+void StreamedImage::bind(const string& labelName, uint32_t pos) {
+  auto found = unresolved.find(labelName);
+  if (found == unresolved.end()) return;
+
+  for (const LabelUse& labelUse : found->second) {
+    uint8_t bytes[4];
+    resolve(labelUse, pos, bytes);
+    patch(labelUse.useLocn, bytes, fixupSize(labelUse));
+  }
+  unresolvedCount -= found->second.size();
+  unresolved.erase(found);
+}
+void StreamedImage::finish(const LabelBinds& labelBinds) {
+  if (!unresolved.empty()) unboundLabel(unresolved.begin()->second.front());
+
+  if (spillFile != nullptr) {  // everything is bound now - resolve the rest
+    rewind(spillFile);
+    uint32_t header[6];
+    while (fread(header, sizeof(uint32_t), 6, spillFile) == 6) {
+      string labelName(header[5], '\0');
+      if (fread(&labelName[0], 1, header[5], spillFile) != header[5]) break;
+      LabelUse labelUse(header[0], labelName, header[4], header[2], header[3],
+                        header[1] != 0);
+
+      auto found = labelBinds.find(labelName);
+      if (found == labelBinds.end()) unboundLabel(labelUse);
+      uint8_t bytes[4];
+      resolve(labelUse, found->second, bytes);
+      patch(labelUse.useLocn, bytes, fixupSize(labelUse));
     }
   }
 
-  return result;
+  flush();
+  claimExtent(extents, blockStart, bufferStart);
+  if (!extents.empty() && extents.rbegin()->second > fileEnd) {
+    fout.seekp(static_cast<streamoff>(extents.rbegin()->second - 1));
+    fout.put('\0');  // extend the file over any trailing hole
+  }
+  fout.flush();
+  if (!fout) throw FileOpenError();
 }
-void replacePlaceholders(vector<uint8_t>& result,
-                         const map<string, uint32_t>& labelBinds,
-                         const list<LabelUse>& labelUses) {
-  for (const auto& iter : labelUses) {
-    auto found = labelBinds.find(iter.labelName);
-    if (found == labelBinds.end()) {
-      throw ParseError(iter.labelLine, iter.labelChar,
-                       "unbound label '" + iter.labelName + "'.");
-    } else if (iter.isPCRel) {
-      long diff = static_cast<long>(iter.useLocn) + 1 -
-                  static_cast<long>(found->second);
-      if (diff % 2 != 0)
-        throw ParseError(
-            iter.labelLine, iter.labelChar,
-            "Cannot have label offset not divisible by two, currently " +
-                hexify(diff) + ".");
-      diff /= 2;
-      if (diff > 0x7f || diff < -0x80)
-        throw ParseError(
-            iter.labelLine, iter.labelChar,
-            "use of label '" + iter.labelName +
-                "' may not be more than 0x80 from its binding, currently " +
-                hexify(2 * diff) + ".");
-      result[iter.useLocn] = static_cast<uint8_t>(static_cast<int8_t>(diff));
-    } else {
-      result[iter.useLocn + 0] =
-          static_cast<uint8_t>((found->second) >> (3 * 8));
-      result[iter.useLocn + 1] =
-          static_cast<uint8_t>((found->second) >> (2 * 8));
-      result[iter.useLocn + 2] =
-          static_cast<uint8_t>((found->second) >> (1 * 8));
-      result[iter.useLocn + 3] =
-          static_cast<uint8_t>((found->second) >> (0 * 8));
+void StreamedImage::flush() {
+  if (buffer.empty()) return;
+  fout.seekp(static_cast<streamoff>(bufferStart));
+  fout.write(reinterpret_cast<const char*>(buffer.data()),
+             static_cast<streamsize>(buffer.size()));
+  bufferStart += buffer.size();
+  fileEnd = max(fileEnd, bufferStart);
+  buffer.clear();
+}
+void StreamedImage::patch(uint32_t locn, const uint8_t* bytes, size_t count) {
+  if (bufferStart <= locn && locn + count <= bufferStart + buffer.size()) {
+    copy(bytes, bytes + count,
+         buffer.begin() + static_cast<long>(locn - bufferStart));
+    return;
+  }
+
+  flush();  // keep the file consistent before touching it directly
+  fout.seekp(static_cast<streamoff>(locn));
+  fout.write(reinterpret_cast<const char*>(bytes),
+             static_cast<streamsize>(count));
+  fileEnd = max(fileEnd, locn + count);
+}
+void StreamedImage::spill() {
+  if (spillFile == nullptr) spillFile = tmpfile();
+  if (spillFile == nullptr) throw FileOpenError();
+
+  for (const auto& entry : unresolved) {
+    for (const LabelUse& labelUse : entry.second) {
+      uint32_t header[6] = {labelUse.useLocn, labelUse.isPCRel ? 1u : 0u,
+                            labelUse.labelLine, labelUse.labelChar,
+                            labelUse.addend,
+                            static_cast<uint32_t>(labelUse.labelName.size())};
+      fwrite(header, sizeof(uint32_t), 6, spillFile);
+      fwrite(labelUse.labelName.data(), 1, labelUse.labelName.size(),
+             spillFile);
     }
   }
+  unresolved.clear();
+  unresolvedCount = 0;
 }
 
 [[noreturn]] void badToken(const const_iter& iter) {
@@ -168,570 +485,1190 @@ void expect(const const_iter& iter, const string& expected,
   }
 }
 
-unsigned long getNumber(const const_iter& iter) {
-  size_t eidx;
-  unsigned long buffer;
-  try {
-    buffer = stoul(iter->value, &eidx, 0);
-  } catch (const invalid_argument&) {
-    throw ParseError(
-        iter->lineNo, iter->charNo,
-        "expected unsigned number, but got '" + iter->value + "'.");
+uint8_t getOneReg(const_iter& iter) {
+  if (iter->value.length() != 2 || iter->value[0] != 'r' ||
+      (iter->value[1] < '0' || iter->value[1] > '7'))
+    throw ParseError(iter->lineNo, iter->charNo,
+                     "Expected r[0-7], got '" + iter->value + "'.");
+  return iter->value[1] - '0';
+}
+bool isRegister(const string& s) {
+  return s.length() == 2 && s[0] == 'r' && s[1] >= '0' && s[1] <= '7';
+}
+
+// what an expression works out to - a number, or a label's address plus one
+struct Value {
+  long number;
+  string label;    // empty if it's just a number
+  bool isForward;  // if it's from a difference with a label bound after it
+};
+
+// whether iter opens the parentheses around a base register
+bool startsBase(const const_iter& iter, const const_iter& end) {
+  return iter->value == "(" && iter + 1 != end && isRegister((iter + 1)->value);
+}
+// Finds the end of the expression starting at iter - the first comma, newline,
+// unmatched ')', or '(' around a base register after it.
+const_iter expressionEnd(const_iter iter, const const_iter& end) {
+  for (unsigned depth = 0; iter != end; ++iter) {
+    if (iter->value == "," || iter->value == "\n" ||
+        (depth == 0 && (iter->value == ")" || startsBase(iter, end))))
+      break;
+    if (iter->value == "(") depth++;
+    if (iter->value == ")") depth--;
   }
-  if (eidx != iter->value.length()) {
-    badToken(iter);
-  } else {
-    return buffer;
+  return iter;
+}
+// tokens first through last, as written
+string textOf(const_iter first, const const_iter& last) {
+  string text = first->value;
+  while (first != last) text += (++first)->value;
+  return text;
+}
+
+bool isMnemonic(const string& s) {
+  return any_of(
+      INSTRUCTION_FORMS.begin(), INSTRUCTION_FORMS.end(),
+      [&s](const InstructionForm& form) { return form.mnemonic == s; });
+}
+
+struct Operand {
+  OperandKind kind;
+  const_iter start;
+  const_iter value;  // offset, immediate, or target - end if not given
+  uint8_t first;     // register, or base register
+  uint8_t second;    // index register
+};
+
+// parses one operand, leaving iter on its last token - values are only
+// skipped over, to be worked out once the form is known
+Operand getOperand(const_iter& iter, const const_iter& end) {
+  Operand operand{OperandKind::REGISTER, iter, end, 0, 0};
+  if (iter->value == "$") {
+    requireNext(iter, end);
+    ++iter;
+    operand.kind = OperandKind::IMMEDIATE;
+    operand.value = iter;
+    iter = expressionEnd(iter, end) - 1;
+    return operand;
+  } else if (isRegister(iter->value)) {
+    operand.first = getOneReg(iter);
+    return operand;
+  }
+
+  bool indirect = false;
+  if (iter->value == "*") {
+    indirect = true;
+    requireNext(iter, end);
+    ++iter;
+  }
+  if (!startsBase(iter, end)) {
+    operand.value = iter;
+    iter = expressionEnd(iter, end) - 1;
+    if (!indirect && (iter + 1 == end || (iter + 1)->value != "(")) {
+      operand.kind = OperandKind::TARGET;
+      return operand;
+    }
+    requireNext(iter, end);
+    ++iter;
+    expect(iter, "(");
+  }
+
+  requireNext(iter, end);
+  ++iter;
+  operand.first = getOneReg(iter);
+  requireNext(iter, end);
+  ++iter;
+  if (iter->value == ")") {  // o(rb) or (rb)
+    operand.kind =
+        indirect ? OperandKind::INDIRECT_MEMORY : OperandKind::MEMORY;
+    return operand;
+  }
+
+  expect(iter, ",", ",' or ')");  // (rb, ri, 4)
+  if (operand.value != end)
+    throw ParseError(operand.value->lineNo, operand.value->charNo,
+                     "indexed operands may not have an offset.");
+  requireNext(iter, end);
+  ++iter;
+  operand.second = getOneReg(iter);
+  requireNext(iter, end);
+  ++iter;
+  expect(iter, ",");
+  requireNext(iter, end);
+  ++iter;
+  expect(iter, "4");
+  requireNext(iter, end);
+  ++iter;
+  expect(iter, ")");
+  operand.kind =
+      indirect ? OperandKind::INDIRECT_INDEXED : OperandKind::INDEXED;
+  return operand;
+}
+// parses the comma separated operands following iter, leaving iter on the last
+// token of the last operand
+vector<Operand> getOperands(const_iter& iter, const const_iter& end) {
+  vector<Operand> operands;
+  if (iter + 1 == end || (iter + 1)->value == "\n") return operands;
+
+  ++iter;
+  operands.push_back(getOperand(iter, end));
+  while (iter + 1 != end && (iter + 1)->value == ",") {
+    ++iter;
+    requireNext(iter, end);
+    ++iter;
+    operands.push_back(getOperand(iter, end));
+  }
+  return operands;
+}
+const InstructionForm& matchForm(const const_iter& mnemonic,
+                                 const vector<Operand>& operands) {
+  for (const InstructionForm& form : INSTRUCTION_FORMS) {
+    if (form.mnemonic != mnemonic->value ||
+        form.operandCount != operands.size())
+      continue;
+    bool matches = true;
+    for (size_t idx = 0; idx < operands.size(); idx++)
+      matches = matches && form.operands[idx].kind == operands[idx].kind;
+    if (matches) return form;
+  }
+  throw ParseError(mnemonic->lineNo, mnemonic->charNo,
+                   "invalid operands for '" + mnemonic->value + "'.");
+}
+
+void setRegister(Fields& fields, char field, uint8_t reg) {
+  switch (field) {
+    case 's':
+      fields.s = reg;
+      break;
+    case 'd':
+      fields.d = reg;
+      break;
+    case 'b':
+      fields.b = reg;
+      break;
+    case 'i':
+      fields.i = reg;
+      break;
+    default:
+      break;
   }
 }
-long getNumberSigned(const const_iter& iter) {
-  size_t eidx;
-  long buffer;
+
+// checks a value field, worked out from the tokens first through last,
+// against the form's constraints
+uint32_t getValue(const const_iter& first, const const_iter& last,
+                  const Value& value, const InstructionForm& form) {
+  const ValueSpec& spec = form.value;
+  string text = textOf(first, last);
+  if (!value.label.empty())
+    throw ParseError(first->lineNo, first->charNo,
+                     "expected number, but got address '" + text + "'.");
+  if (spec.min >= 0 && value.number < 0)
+    throw ParseError(first->lineNo, first->charNo,
+                     "expected unsigned number, but got '" + text + "'.");
+  long buffer = value.number;
+
+  string scaled = spec.scale == 4 ? "a quarter of "
+                                  : spec.scale == 2 ? "half of " : "";
+  string width = valueWidth(form) == 8
+                     ? "4 bytes"
+                     : valueWidth(form) == 2 ? "1 byte" : "1 nibble";
+  if (buffer % spec.scale != 0)
+    throw ParseError(first->lineNo, first->charNo,
+                     text + " must be divisible by " +
+                         (spec.scale == 4 ? "four." : "two."));
+  buffer /= spec.scale;
+  if (buffer > spec.max || buffer < spec.min)
+    throw ParseError(first->lineNo, first->charNo,
+                     "out of range: " + scaled + text + " must fit in " +
+                         width + ".");
+  if (spec.negate) buffer = -buffer;
+  return static_cast<uint32_t>(buffer);
+}
+
+// Captures a single line, relative to where the line starts.
+class LineImage : public Image {
+ public:
+  explicit LineImage(LineCode& code) noexcept;
+
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void align(uint32_t alignment, uint64_t padding) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+
+ private:
+  LineCode& code;
+};
+
+LineImage::LineImage(LineCode& c) noexcept : code{c} {}
+void LineImage::setPos(uint32_t pos) { code.pos = pos; }
+void LineImage::write(const uint8_t* bytes, size_t count) {
+  code.bytes.insert(code.bytes.end(), bytes, bytes + count);
+}
+// a line is one statement, so nothing is written after its fill
+void LineImage::fill(uint8_t value, uint64_t count) {
+  code.fillCount += count;
+  code.fillValue = value;
+}
+void LineImage::align(uint32_t alignment, uint64_t) { code.align = alignment; }
+void LineImage::use(const LabelUse& labelUse, const LabelBinds&) {
+  code.uses.push_back(labelUse);
+}
+void LineImage::bind(const string& labelName, uint32_t) {
+  code.labels.push_back(labelName);
+}
+
+// Captures a .rept body, relative to where the body starts, as runs of bytes
+// and fills - so the fills never take up memory, however big they are.
+class BodyImage : public Image {
+ public:
+  BodyImage() noexcept;
+
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void align(uint32_t alignment, uint64_t padding) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+  void instruction(const Instruction& instruction,
+                   const optional<LabelUse>& use,
+                   const LabelBinds& labelBinds) override;
+  void repeat(const ReptPiece& piece, unsigned long copy, uint64_t pos,
+              const LabelBinds& labelBinds) override;
+  void line(unsigned lineNo) override;
+
+  const vector<ReptPiece>& pieces() const noexcept;
+  uint64_t size() const noexcept;
+  // whether the body binds labels or moves the position, so its bytes depend
+  // on where it goes
+  bool dependsOnPlacement() const noexcept;
+
+ private:
+  vector<ReptPiece> runs;
+  uint64_t currPos;
+  uint64_t pieceStart;  // of the last piece
+  uint32_t currLine;
+  bool isPlaced;
+};
+
+BodyImage::BodyImage() noexcept
+    : currPos{0}, pieceStart{0}, currLine{0}, isPlaced{false} {}
+void BodyImage::setPos(uint32_t) { isPlaced = true; }
+void BodyImage::write(const uint8_t* bytes, size_t count) {
+  if (runs.empty() || runs.back().bytes.empty()) {
+    runs.push_back(ReptPiece{{}, {}, {}, 0, 0});
+    pieceStart = currPos;
+  }
+  runs.back().bytes.insert(runs.back().bytes.end(), bytes, bytes + count);
+  currPos += count;
+}
+void BodyImage::fill(uint8_t value, uint64_t count) {
+  runs.push_back(ReptPiece{{}, {}, {}, count, value});
+  currPos += count;
+}
+void BodyImage::align(uint32_t, uint64_t padding) {
+  isPlaced = true;
+  fill(0, padding);
+}
+void BodyImage::use(const LabelUse& labelUse, const LabelBinds&) {
+  runs.back().uses.push_back(labelUse);
+  runs.back().uses.back().useLocn -= static_cast<uint32_t>(pieceStart);
+}
+void BodyImage::bind(const string&, uint32_t) { isPlaced = true; }
+void BodyImage::instruction(const Instruction& instruction,
+                            const optional<LabelUse>& labelUse,
+                            const LabelBinds& labelBinds) {
+  uint64_t start = currPos;
+  Image::instruction(instruction, labelUse, labelBinds);
+  runs.back().instructions.push_back(Program::ChunkInstruction{
+      static_cast<uint32_t>(start - pieceStart), currLine,
+      static_cast<uint8_t>(instruction.form - INSTRUCTION_FORMS.data())});
+}
+void BodyImage::repeat(const ReptPiece& piece, unsigned long copy,
+                       uint64_t pos, const LabelBinds& labelBinds) {
+  Image::repeat(piece, copy, pos, labelBinds);
+  for (Program::ChunkInstruction instruction : piece.instructions) {
+    instruction.offset += static_cast<uint32_t>(pos - pieceStart);
+    runs.back().instructions.push_back(instruction);
+  }
+}
+void BodyImage::line(unsigned lineNo) { currLine = lineNo; }
+const vector<ReptPiece>& BodyImage::pieces() const noexcept { return runs; }
+uint64_t BodyImage::size() const noexcept { return currPos; }
+bool BodyImage::dependsOnPlacement() const noexcept { return isPlaced; }
+
+// Keeps everything as a Program, to be placed later.
+class ProgramImage : public Image {
+ public:
+  explicit ProgramImage(Program& program) noexcept;
+
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void include(const shared_ptr<const MappedFile>& file, uint64_t offset,
+               uint64_t size) override;
+  void align(uint32_t alignment, uint64_t padding) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+  void instruction(const Instruction& instruction,
+                   const optional<LabelUse>& use,
+                   const LabelBinds& labelBinds) override;
+  void word(uint32_t value, const optional<LabelUse>& use,
+            const LabelBinds& labelBinds) override;
+  void repeat(const ReptPiece& piece, unsigned long copy, uint64_t pos,
+              const LabelBinds& labelBinds) override;
+  void line(unsigned lineNo) override;
+  void subtract(const string& a, const string& b) override;
+
+ private:
+  // the symbol naming labelName, added if it's new
+  uint32_t symbolOf(const string& labelName);
+  uint32_t symbolUse(const LabelUse& use);
+
+  Program& program;
+  unordered_map<string, uint32_t> symbols;
+  // the chunk made for each .rept piece, which later copies share
+  unordered_map<const ReptPiece*, uint32_t> repeated;
+  uint64_t currPos;
+  uint64_t chunkStart;  // of the last chunk
+  uint32_t currLine;
+};
+
+ProgramImage::ProgramImage(Program& p) noexcept
+    : program{p}, currPos{0}, chunkStart{0}, currLine{0} {}
+void ProgramImage::setPos(uint32_t pos) {
+  program.push(Program::POS, 0, pos, currLine);
+  currPos = pos;
+}
+void ProgramImage::write(const uint8_t* bytes, size_t count) {
+  program.push(Program::BYTES, 0,
+               static_cast<uint32_t>(program.chunks.size()), currLine);
+  program.chunks.push_back(Program::Chunk{
+      pmr::vector<uint8_t>(bytes, bytes + count, program.resource()),
+      pmr::vector<LabelUse>(program.resource()),
+      pmr::vector<Program::ChunkInstruction>(program.resource())});
+  chunkStart = currPos;
+  currPos += count;
+}
+void ProgramImage::fill(uint8_t value, uint64_t count) {
+  program.push(Program::FILL, 0, static_cast<uint32_t>(program.fills.size()),
+               currLine);
+  program.fills.push_back(Program::Fill{count, value});
+  currPos += count;
+}
+void ProgramImage::include(const shared_ptr<const MappedFile>& file,
+                           uint64_t offset, uint64_t size) {
+  program.push(Program::INCLUDE, 0,
+               static_cast<uint32_t>(program.includes.size()), currLine);
+  program.includes.push_back(Program::Include{file, offset, size});
+  currPos += size;
+}
+void ProgramImage::align(uint32_t alignment, uint64_t padding) {
+  program.push(Program::ALIGN, 0, alignment, currLine);
+  currPos += padding;
+}
+void ProgramImage::use(const LabelUse& labelUse, const LabelBinds&) {
+  program.chunks.back().uses.push_back(labelUse);
+  program.chunks.back().uses.back().useLocn -=
+      static_cast<uint32_t>(chunkStart);
+}
+void ProgramImage::bind(const string& labelName, uint32_t) {
+  program.push(Program::LABEL, 0, symbolOf(labelName), currLine);
+}
+void ProgramImage::instruction(const Instruction& instruction,
+                               const optional<LabelUse>& labelUse,
+                               const LabelBinds&) {
+  uint8_t op =
+      static_cast<uint8_t>(instruction.form - INSTRUCTION_FORMS.data());
+  program.push(labelUse ? op | Program::SYMBOLIC : op,
+               packRegisters(instruction.fields),
+               labelUse ? symbolUse(*labelUse) : instruction.fields.value,
+               currLine);
+  currPos += instructionSize(*instruction.form);
+}
+void ProgramImage::word(uint32_t value, const optional<LabelUse>& labelUse,
+                        const LabelBinds&) {
+  program.push(labelUse ? Program::LONG | Program::SYMBOLIC : Program::LONG, 0,
+               labelUse ? symbolUse(*labelUse) : value, currLine);
+  currPos += 4;
+}
+void ProgramImage::repeat(const ReptPiece& piece, unsigned long copy,
+                          uint64_t pos, const LabelBinds& labelBinds) {
+  if (copy == 0) {
+    Image::repeat(piece, copy, pos, labelBinds);
+    program.chunks.back().instructions.assign(piece.instructions.begin(),
+                                              piece.instructions.end());
+    repeated[&piece] = static_cast<uint32_t>(program.chunks.size() - 1);
+    return;
+  }
+  program.push(Program::BYTES, 0, repeated.at(&piece), currLine);
+  chunkStart = currPos;
+  currPos += piece.bytes.size();
+}
+void ProgramImage::line(unsigned lineNo) { currLine = lineNo; }
+void ProgramImage::subtract(const string& a, const string& b) {
+  program.differences.push_back(Program::Difference{symbolOf(a), symbolOf(b)});
+}
+uint32_t ProgramImage::symbolOf(const string& labelName) {
+  // only allocates if labelName is new, unlike emplace
+  auto found = symbols.try_emplace(
+      labelName, static_cast<uint32_t>(program.symbols.size()));
+  if (found.second) program.symbols.emplace_back(labelName);
+  return found.first->second;
+}
+uint32_t ProgramImage::symbolUse(const LabelUse& labelUse) {
+  program.symbolUses.push_back(Program::SymbolUse{
+      symbolOf(labelUse.labelName), labelUse.addend, labelUse.labelChar});
+  return static_cast<uint32_t>(program.symbolUses.size() - 1);
+}
+
+// Compares everything written against an expected image instead of keeping
+// it, throwing the Mismatch at the first byte that differs. Only the last
+// write is held back, until any label uses in it are filled in.
+class VerifyingImage : public Image {
+ public:
+  VerifyingImage(const uint8_t* expected, uint64_t size) noexcept;
+
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+
+  // compares the last write
+  void finish();
+
+ private:
+  void compare(uint64_t pos, const uint8_t* bytes, size_t count) const;
+
+  const uint8_t* expected;
+  uint64_t size;
+  uint64_t currPos;
+  uint64_t pendingStart;
+  vector<uint8_t> pending;  // the last write
+};
+
+VerifyingImage::VerifyingImage(const uint8_t* e, uint64_t s) noexcept
+    : expected{e}, size{s}, currPos{0}, pendingStart{0} {}
+void VerifyingImage::setPos(uint32_t pos) {
+  finish();
+  currPos = pos;
+}
+void VerifyingImage::write(const uint8_t* bytes, size_t count) {
+  finish();
+  pending.assign(bytes, bytes + count);
+  pendingStart = currPos;
+  currPos += count;
+}
+void VerifyingImage::fill(uint8_t value, uint64_t count) {
+  finish();
+  if (count > size - min(currPos, size)) throw Mismatch{size, 0};
+  const uint8_t* begin = expected + currPos;
+  const uint8_t* found = find_if(begin, begin + count, [value](uint8_t byte) {
+    return byte != value;
+  });
+  if (found != begin + count)
+    throw Mismatch{currPos + static_cast<uint64_t>(found - begin), 0};
+  currPos += count;
+}
+void VerifyingImage::use(const LabelUse& labelUse,
+                         const LabelBinds& labelBinds) {
+  auto found = labelBinds.find(labelUse.labelName);
+  if (found == labelBinds.end()) unboundLabel(labelUse);
+  resolve(labelUse, found->second, &pending[labelUse.useLocn - pendingStart]);
+}
+void VerifyingImage::bind(const string&, uint32_t) {}
+void VerifyingImage::finish() {
+  compare(pendingStart, pending.data(), pending.size());
+  pending.clear();
+}
+void VerifyingImage::compare(uint64_t pos, const uint8_t* bytes,
+                             size_t count) const {
+  if (count > size - min(pos, size)) throw Mismatch{size, 0};
+  auto found = mismatch(bytes, bytes + count, expected + pos);
+  if (found.first != bytes + count)
+    throw Mismatch{pos + static_cast<uint64_t>(found.first - bytes), 0};
+}
+
+// Places the program nowhere, only filling in label uses, one at a time, and
+// warning about overwritten bytes, as placing it would.
+class CheckingImage : public Image {
+ public:
+  CheckingImage() noexcept;
+
+  void setPos(uint32_t pos) override;
+  void write(const uint8_t* bytes, size_t count) override;
+  void fill(uint8_t value, uint64_t count) override;
+  void use(const LabelUse& use, const LabelBinds& labelBinds) override;
+  void bind(const string& labelName, uint32_t pos) override;
+
+  void finish();
+
+ private:
+  map<uint64_t, uint64_t> extents;
+  uint64_t runStart;
+  uint64_t currPos;
+};
+
+CheckingImage::CheckingImage() noexcept : runStart{0}, currPos{0} {}
+void CheckingImage::setPos(uint32_t pos) {
+  finish();
+  runStart = currPos = pos;
+}
+void CheckingImage::write(const uint8_t*, size_t count) { currPos += count; }
+void CheckingImage::fill(uint8_t, uint64_t count) {
+  finish();
+  currPos += count;
+  finish();
+}
+void CheckingImage::use(const LabelUse& labelUse,
+                        const LabelBinds& labelBinds) {
+  auto found = labelBinds.find(labelUse.labelName);
+  if (found == labelBinds.end()) unboundLabel(labelUse);
+  uint8_t bytes[4];
+  resolve(labelUse, found->second, bytes);
+}
+void CheckingImage::bind(const string&, uint32_t) {}
+void CheckingImage::finish() {
+  claimExtent(extents, runStart, currPos);
+  runStart = currPos;
+}
+
+// a .rept whose body is still being read
+struct Rept {
+  Token directive;
+  unsigned long count;
+  unsigned depth;  // of nested .repts, including this one
+  vector<Token> body;
+};
+
+// a .equ constant, worked out the first time it's used
+struct Constant {
+  vector<Token> definition;  // its line, from the name on
+  optional<Value> value;
+  bool isEvaluating;  // so ones defined in terms of themselves are caught
+};
+
+// state carried from one statement to the next
+struct Assembler {
+  Image& image;
+  uint64_t currPos;  // may reach one past the end of memory
+  LabelBinds labelBinds;
+  map<string, Constant> constants;
+  optional<Rept> rept;  // set between a .rept and its .endr
+  const LabelBinds* laidOut;  // every label's address, if already known
+  bool isEstimating;  // if differences with labels bound later count as 0
+  bool isEstimated;   // if any did
+  Assembler* outer;   // the program a .rept body is in, or null if not a body
+};
+
+// Constants belong to the whole program - a .rept body shares them, so each is
+// still worked out once.
+map<string, Constant>& constantsOf(Assembler& state) {
+  return state.outer != nullptr ? state.outer->constants : state.constants;
+}
+
+Value getExpression(Assembler& state, const_iter& iter, const const_iter& end);
+
+// The value of a constant, worked out from its definition the first time.
+// Constants it depends on are worked out first, deepest first, from an explicit
+// stack - so however long a chain of them is, the expression parser only ever
+// sees constants that are already known.
+Value constantValue(Assembler& state, Constant& constant,
+                    const const_iter& use) {
+  struct Pending {
+    Constant* constant;
+    const_iter use;
+    bool isExpanded;  // whether what it depends on is on the stack above it
+  };
+  if (constant.value) return *constant.value;
+  vector<Pending> stack{Pending{&constant, use, false}};
+  while (!stack.empty()) {
+    Pending& top = stack.back();
+    Constant& current = *top.constant;
+    if (current.value) {
+      stack.pop_back();
+      continue;
+    }
+    if (!top.isExpanded) {
+      if (current.isEvaluating)
+        throw ParseError(top.use->lineNo, top.use->charNo,
+                         "constant '" + top.use->value +
+                             "' is defined in terms of itself.");
+      current.isEvaluating = true;
+      top.isExpanded = true;
+      const vector<Token>& definition = current.definition;
+      for (auto iter = definition.cend() - 1; iter != definition.cbegin() + 1;
+           --iter) {  // pushed backwards, so they're worked out in order
+        auto found = constantsOf(state).find(iter->value);
+        if (found != constantsOf(state).end() && !found->second.value)
+          stack.push_back(Pending{&found->second, iter, false});
+      }
+      continue;
+    }
+
+    const vector<Token>& definition = current.definition;
+    auto iter = definition.cbegin() + 2;  // past the name and comma
+    Value value = getExpression(state, iter, definition.cend());
+    if (++iter != definition.cend())
+      throw ParseError(iter->lineNo, iter->charNo,
+                       "expected newline, but got '" + iter->value + "'.");
+    current.isEvaluating = false;
+    current.value = value;
+    stack.pop_back();
+  }
+  return *constant.value;
+}
+
+Value getSum(Assembler& state, const_iter& iter, const const_iter& end);
+
+// A number, label, constant, negation, or sum in parentheses, leaving iter
+// just past it. Labels are only known by name - their address comes later,
+// unless they're subtracted from each other.
+Value getTerm(Assembler& state, const_iter& iter, const const_iter& end) {
+  if (iter == end)
+    throw ParseError((iter - 1)->lineNo, (iter - 1)->charNo,
+                     "expected number or label after '" + (iter - 1)->value +
+                         "'.");
+  const const_iter term = iter++;
+  if (term->value == "-") {
+    Value value = getTerm(state, iter, end);
+    if (!value.label.empty())
+      throw ParseError(term->lineNo, term->charNo, "cannot negate an address.");
+    value.number =
+        static_cast<long>(0 - static_cast<unsigned long>(value.number));
+    return value;
+  } else if (term->value == "(") {
+    Value value = getSum(state, iter, end);
+    if (iter == end || iter->value != ")")
+      throw ParseError(term->lineNo, term->charNo, "expected ')' for '('.");
+    ++iter;
+    return value;
+  } else if (validLabel(term->value)) {
+    auto found = constantsOf(state).find(term->value);
+    if (found == constantsOf(state).end())
+      return Value{0, term->value, false};
+    return constantValue(state, found->second, term);
+  }
+
+  size_t eidx = 0;
+  unsigned long number = 0;
   try {
-    buffer = stol(iter->value, &eidx, 0);
+    number = stoul(term->value, &eidx, 0);
   } catch (const invalid_argument&) {
-    throw ParseError(iter->lineNo, iter->charNo,
-                     "expected sighed number, but got '" + iter->value + "'.");
+    eidx = 0;
+  } catch (const out_of_range&) {
+    number = numeric_limits<unsigned long>::max();
+    eidx = term->value.length();
   }
-  if (eidx != iter->value.length()) {
-    badToken(iter);
-  } else {
-    return buffer;
+  if (eidx != term->value.length())
+    throw ParseError(term->lineNo, term->charNo,
+                     "expected number or label, but got '" + term->value +
+                         "'.");
+  if (number > static_cast<unsigned long>(numeric_limits<long>::max()))
+    throw ParseError(term->lineNo, term->charNo,
+                     "out of range: " + term->value + " is too large.");
+  return Value{static_cast<long>(number), "", false};
+}
+// terms multiplied or divided together, leaving iter just past them
+Value getProduct(Assembler& state, const_iter& iter, const const_iter& end) {
+  Value value = getTerm(state, iter, end);
+  while (iter != end && (iter->value == "*" || iter->value == "/")) {
+    const const_iter op = iter++;
+    Value other = getTerm(state, iter, end);
+    if (!value.label.empty() || !other.label.empty())
+      throw ParseError(op->lineNo, op->charNo,
+                       "cannot multiply or divide an address.");
+    value.isForward = value.isForward || other.isForward;
+    // worked out unsigned, so that overflow wraps around
+    unsigned long a = static_cast<unsigned long>(value.number);
+    unsigned long b = static_cast<unsigned long>(other.number);
+    if (op->value == "*")
+      value.number = static_cast<long>(a * b);
+    else if (b == 0 && other.isForward && state.isEstimating)
+      value.number = 0;  // the estimate, not the real divisor, is 0
+    else if (b == 0)
+      throw ParseError(op->lineNo, op->charNo, "division by zero.");
+    else if (other.number == -1)  // the one quotient that can overflow
+      value.number = static_cast<long>(0 - a);
+    else
+      value.number /= other.number;
   }
+  return value;
 }
-void addInt(uint32_t number, Block& b) {
-  b.bytes.push_back(static_cast<uint8_t>(number >> (3 * 8)));
-  b.bytes.push_back(static_cast<uint8_t>(number >> (2 * 8)));
-  b.bytes.push_back(static_cast<uint8_t>(number >> (1 * 8)));
-  b.bytes.push_back(static_cast<uint8_t>(number >> (0 * 8)));
+// The address of label a less that of label b, for a - b at op. Labels bound
+// after op are only known once the program has been laid out - until then,
+// they're estimated if the program is to be assembled again, and rejected if
+// not.
+Value labelDifference(Assembler& state, const const_iter& op, const string& a,
+                      const string& b) {
+  auto distance = [](uint32_t to, uint32_t from) {
+    return static_cast<long>(to) - static_cast<long>(from);
+  };
+  auto foundA = state.labelBinds.find(a);
+  auto foundB = state.labelBinds.find(b);
+  if (state.outer != nullptr) {
+    // a body that binds labels is assembled again in place, so a difference
+    // with those can be anything for now - any others are the program's
+    if (foundA != state.labelBinds.end() || foundB != state.labelBinds.end())
+      return Value{0, "", false};
+    return labelDifference(*state.outer, op, a, b);
+  }
+  state.image.subtract(a, b);
+  if (foundA != state.labelBinds.end() && foundB != state.labelBinds.end())
+    return Value{distance(foundA->second, foundB->second), "", false};
+  if (state.laidOut != nullptr) {
+    auto addressOf = [&](const string& label) {
+      auto found = state.labelBinds.find(label);
+      if (found != state.labelBinds.end()) return found->second;
+      auto laid = state.laidOut->find(label);
+      if (laid == state.laidOut->end())
+        throw ParseError(op->lineNo, op->charNo,
+                         "unbound label '" + label + "'.");
+      return laid->second;
+    };
+    return Value{distance(addressOf(a), addressOf(b)), "", true};
+  }
+  if (!state.isEstimating)
+    throw ParseError(op->lineNo, op->charNo,
+                     "cannot subtract an address before it's bound.");
+  state.isEstimated = true;
+  return Value{0, "", true};
 }
-uint32_t getInt(const const_iter& iter) {
-  unsigned long buffer = getNumber(iter);
-  if (buffer > numeric_limits<uint32_t>().max())
-    throw ParseError(iter->lineNo, iter->charNo,
-                     "out of range: " + iter->value + " must fit in 4 bytes.");
-  return static_cast<uint32_t>(buffer);
+// products added or subtracted together, leaving iter just past them
+Value getSum(Assembler& state, const_iter& iter, const const_iter& end) {
+  Value value = getProduct(state, iter, end);
+  while (iter != end && (iter->value == "+" || iter->value == "-")) {
+    const const_iter op = iter++;
+    Value other = getProduct(state, iter, end);
+    if (!other.label.empty() && (op->value == "+" || value.label.empty()))
+      throw ParseError(op->lineNo, op->charNo,
+                       op->value == "-" ? "cannot subtract an address."
+                                        : "cannot add two addresses.");
+    unsigned long number = static_cast<unsigned long>(other.number);
+    if (op->value == "-") number = 0 - number;
+    if (!other.label.empty()) {  // the difference is just a number
+      Value difference = labelDifference(state, op, value.label, other.label);
+      number += static_cast<unsigned long>(difference.number);
+      value.label.clear();
+      other = difference;
+    }
+    value.number =
+        static_cast<long>(static_cast<unsigned long>(value.number) + number);
+    if (value.label.empty()) value.label = other.label;
+    value.isForward = value.isForward || other.isForward;
+  }
+  return value;
 }
-uint8_t getOneReg(const_iter& iter) {
-  if (iter->value.length() != 2 || iter->value[0] != 'r' ||
-      (iter->value[1] < '0' || iter->value[1] > '7'))
-    throw ParseError(iter->lineNo, iter->charNo,
-                     "Expected r[0-7], got '" + iter->value + "'.");
-  return iter->value[1] - '0';
+
+// Works out the expression starting at iter - numbers, labels, and .equ
+// constants, combined with + - * / and parentheses - leaving iter on its last
+// token. An expression with a label in it has to come to the label's address
+// plus a number, which is then resolved along with the label; one label less
+// another is just a number.
+Value getExpression(Assembler& state, const_iter& iter, const const_iter& end) {
+  const const_iter stop = expressionEnd(iter, end);
+  Value value = getSum(state, iter, stop);
+  if (iter != stop) badToken(iter);
+  --iter;
+  return value;
 }
-uint8_t getTwoRegs(const_iter& iter, const const_iter& end) {
-  uint8_t acc = getOneReg(iter);
+// checks that the value of the tokens first through last is an unsigned
+// number, and, for intOf, that it fits in 4 bytes
+unsigned long numberOf(const const_iter& first, const const_iter& last,
+                       const Value& value) {
+  if (!value.label.empty() || value.number < 0)
+    throw ParseError(first->lineNo, first->charNo,
+                     "expected unsigned number, but got '" +
+                         textOf(first, last) + "'.");
+  return static_cast<unsigned long>(value.number);
+}
+uint32_t intOf(const const_iter& first, const const_iter& last,
+               const Value& value) {
+  unsigned long number = numberOf(first, last, value);
+  if (number > numeric_limits<uint32_t>::max())
+    throw ParseError(first->lineNo, first->charNo,
+                     "out of range: " + textOf(first, last) +
+                         " must fit in 4 bytes.");
+  return static_cast<uint32_t>(number);
+}
+// checks that a value the layout depends on has no label bound after it in it,
+// so that every label is bound where it'll be placed
+void checkLayout(const const_iter& first, const const_iter& last,
+                 const Value& value) {
+  if (value.isForward)
+    throw ParseError(first->lineNo, first->charNo,
+                     "'" + textOf(first, last) +
+                         "' uses an address bound after it.");
+}
+// works out a directive's expression that has to be an unsigned number
+unsigned long getNumber(Assembler& state, const_iter& iter,
+                        const const_iter& end) {
+  const const_iter first = iter;
+  Value value = getExpression(state, iter, end);
+  checkLayout(first, iter, value);
+  return numberOf(first, iter, value);
+}
+uint32_t getInt(Assembler& state, const_iter& iter, const const_iter& end) {
+  const const_iter first = iter;
+  Value value = getExpression(state, iter, end);
+  checkLayout(first, iter, value);
+  return intOf(first, iter, value);
+}
+
+// Records the .equ whose name is at iter, leaving iter on the last token of
+// its line. The same .equ can be seen more than once, as it's found ahead of
+// time, and as .rept bodies are assembled again.
+void defineConstant(Assembler& state, const_iter& iter, const const_iter& end) {
+  const const_iter name = iter;
+  if (!validLabel(name->value) || isRegister(name->value))
+    throw ParseError(name->lineNo, name->charNo,
+                     "expected constant name, but got '" + name->value + "'.");
   requireNext(iter, end);
   ++iter;
   expect(iter, ",");
-  requireNext(iter, end);
-  ++iter;
-  acc = (acc << 4) | getOneReg(iter);
-  return acc;
+  const_iter lineEnd = find_if(
+      iter, end, [](const Token& token) { return token.value == "\n"; });
+  iter = lineEnd - 1;
+
+  map<string, Constant>& constants = constantsOf(state);
+  auto found = constants.find(name->value);
+  if (found != constants.end()) {
+    const Token& defined = found->second.definition.front();
+    if (defined.lineNo != name->lineNo || defined.charNo != name->charNo)
+      throw ParseError(name->lineNo, name->charNo,
+                       "cannot redefine constant '" + name->value + "'.");
+    return;
+  }
+  const Assembler& program = state.outer != nullptr ? *state.outer : state;
+  if (program.labelBinds.count(name->value) != 0)
+    throw ParseError(name->lineNo, name->charNo,
+                     "cannot reuse label '" + name->value + "'.");
+  constants.emplace(name->value,
+                    Constant{vector<Token>(name, lineEnd), {}, false});
 }
 
-}  // namespace
+// checks that nothing was left open at the end of the source
+void checkComplete(const Assembler& state) {
+  if (state.rept)
+    throw ParseError(state.rept->directive.lineNo,
+                     state.rept->directive.charNo,
+                     "expected '.endr' for '.rept', but reached end of file.");
+}
 
-ParseError::ParseError(unsigned l, unsigned c, string m) noexcept
-    : msg{to_string(l) + ":" + to_string(c) + ":" + m} {}
-const char* ParseError::what() const noexcept { return msg.c_str(); }
+// checks that count bytes fit at the current position
+void reserve(const Assembler& state, const const_iter& iter, uint64_t count) {
+  if (count > MEMORY_SIZE - state.currPos)
+    throw ParseError(iter->lineNo, iter->charNo,
+                     "'" + iter->value + "' is past end of memory.");
+}
+// pads to the next multiple of alignment
+void pad(Assembler& state, const const_iter& iter, uint32_t alignment) {
+  uint64_t padding = (alignment - state.currPos % alignment) % alignment;
+  reserve(state, iter, padding);
+  state.image.align(alignment, padding);
+  state.currPos += padding;
+}
+// writes an address worked out from the expression at first, once its label
+// is known
+void emitAddress(Assembler& state, const const_iter& directive,
+                 const const_iter& first, const Value& address) {
+  reserve(state, directive, 4);
+  state.image.word(0x5a5a5a5a,
+                   LabelUse(static_cast<uint32_t>(state.currPos),
+                            address.label,
+                            static_cast<uint32_t>(address.number),
+                            first->lineNo, first->charNo, false),
+                   state.labelBinds);
+  state.currPos += 4;
+}
 
-vector<uint8_t> generateBinary(const vector<Token>& tokens) {
-  vector<Block> blocks;
-  map<string, uint32_t> labelBinds;
-  list<LabelUse> labelUses;
-  // tuple<address, difference?, tuple<labelName, useLine, useColumn>>
+void assemble(Assembler& state, const vector<Token>& tokens);
 
-  uint32_t currPos = 0;
-  Block currBlock;
-  currBlock.startPos = 0;
+// Assembles a .rept body once, then writes it count times, adding only the
+// label uses for each copy. Fills in the body are written as fills again, so
+// they never take up memory. Bodies that bind labels or move the position
+// depend on where they go, so those are assembled count times instead.
+void repeat(Assembler& state, const Rept& rept) {
+  BodyImage image;
+  Assembler body{image,
+                 0,
+                 {},
+                 {},
+                 {},
+                 nullptr,
+                 false,
+                 false,
+                 state.outer != nullptr ? state.outer : &state};
+  assemble(body, rept.body);
+  checkComplete(body);
+
+  if (image.dependsOnPlacement()) {
+    for (unsigned long copy = 0; copy < rept.count; copy++)
+      assemble(state, rept.body);
+    return;
+  }
+
+  if (image.size() == 0) return;
+  if (rept.count > (MEMORY_SIZE - state.currPos) / image.size())
+    throw ParseError(rept.directive.lineNo, rept.directive.charNo,
+                     "'.rept' is past end of memory.");
+  for (unsigned long copy = 0; copy < rept.count; copy++) {
+    for (const ReptPiece& piece : image.pieces()) {
+      if (piece.bytes.empty()) {
+        state.image.fill(piece.fillValue, piece.fillCount);
+        state.currPos += piece.fillCount;
+      } else {
+        state.image.repeat(piece, copy, state.currPos, state.labelBinds);
+        state.currPos += piece.bytes.size();
+      }
+    }
+  }
+}
 
+void assemble(Assembler& state, const vector<Token>& tokens) {
+  // constants can be used before their .equ, so those are all found first -
+  // any that are malformed are reported once they're reached
   for (auto iter = tokens.cbegin(); iter != tokens.cend(); ++iter) {
-    if (iter->value == "ld") {  // ld something
-      requireNext(iter, tokens.cend());
-      ++iter;
-      if (iter->value == "$") {  // label or literal
-        uint32_t address;
-        requireNext(iter, tokens.cend());
-        currPos += 2;
-        ++iter;
-        if (validLabel(iter->value)) {
-          address = 0x5a5a5a5a;  // magic number - 0x5--- is an invalid opcode
-          labelUses.push_back(LabelUse(currPos, iter->value, iter->lineNo,
-                                       iter->charNo, false));
-        } else {
-          address = getInt(iter);
-        }
-        requireNext(iter, tokens.cend());
-        ++iter;
-        expect(iter, ",");
-        requireNext(iter, tokens.cend());
-        ++iter;
-        currBlock.bytes.push_back(getOneReg(iter));
-        currBlock.bytes.push_back(0x0);
-        addInt(address, currBlock);
-        currPos += 4;
-      } else if (iter->value == "(") {  // (rn) or (rb, ri, 4) forms
-        requireNext(iter, tokens.cend());
-        ++iter;
-        uint8_t temp = getOneReg(iter);
-        requireNext(iter, tokens.cend());
-        ++iter;
-        if (iter->value == ")") {  // (rn) form
-          uint8_t from = temp;
-          currBlock.bytes.push_back(0x10);
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ",");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          currBlock.bytes.push_back((from << 4) | getOneReg(iter));
-        } else {  // (rs, ri, 4) form
-          // 2sid
-          uint8_t base = temp;
-          expect(iter, ",", ",' or '(");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          uint8_t index = getOneReg(iter);
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ",");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, "4");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ")");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ",");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          uint8_t dest = getOneReg(iter);
-          currBlock.bytes.push_back(0x20 | base);
-          currBlock.bytes.push_back((index << 4) | dest);
+    if (iter->value != ".equ" || iter + 1 == tokens.cend()) continue;
+    auto name = iter + 1;
+    try {
+      defineConstant(state, name, tokens.cend());
+    } catch (const ParseError&) {
+    }
+  }
+
+  const_iter labelsEnd = tokens.cbegin();  // of the labels last looked past
+  for (auto iter = tokens.cbegin(); iter != tokens.cend(); ++iter) {
+    state.image.line(iter->lineNo);
+    if (state.rept) {  // collecting a .rept body, up to its .endr
+      if (iter->value == ".rept") state.rept->depth++;
+      if (iter->value != ".endr" || --state.rept->depth != 0) {
+        state.rept->body.push_back(*iter);
+        continue;
+      }
+      Rept rept = move(*state.rept);
+      state.rept.reset();
+      repeat(state, rept);
+    } else if (isMnemonic(iter->value)) {  // instruction
+      const const_iter mnemonic = iter;
+      vector<Operand> operands = getOperands(iter, tokens.cend());
+      const InstructionForm& form = matchForm(mnemonic, operands);
+
+      Fields fields{};
+      const_iter value = tokens.cend();
+      reserve(state, mnemonic, instructionSize(form));
+      for (size_t idx = 0; idx < form.operandCount; idx++) {
+        const OperandSpec& spec = form.operands[idx];
+        const Operand& operand = operands[idx];
+        switch (spec.kind) {
+          case OperandKind::REGISTER:
+            setRegister(fields, spec.field, operand.first);
+            break;
+          case OperandKind::IMMEDIATE:
+          case OperandKind::TARGET:
+            value = operand.value;
+            break;
+          case OperandKind::MEMORY:
+          case OperandKind::INDIRECT_MEMORY:
+            value = operand.value;
+            setRegister(fields, spec.field2, operand.first);
+            break;
+          case OperandKind::INDEXED:
+          case OperandKind::INDIRECT_INDEXED:
+            setRegister(fields, spec.field, operand.first);
+            setRegister(fields, spec.field2, operand.second);
+            break;
+          default:
+            break;
         }
-        currPos += 2;
-      } else {  // o(rn) form
-        unsigned long buffer = getNumber(iter);
-        if (buffer % 4 != 0)
-          throw ParseError(iter->lineNo, iter->charNo,
-                           iter->value + " must be divisible by four.");
-        if (buffer / 4 > 0xf)
-          throw ParseError(iter->lineNo, iter->charNo,
-                           "out of range: a quarter of " + iter->value +
-                               " must fit in 1 nibble.");
-        requireNext(iter, tokens.cend());
-        ++iter;
-        expect(iter, "(");
-        requireNext(iter, tokens.cend());
-        ++iter;
-        uint8_t from = getOneReg(iter);
-        requireNext(iter, tokens.cend());
-        ++iter;
-        expect(iter, ")");
-        requireNext(iter, tokens.cend());
-        ++iter;
-        expect(iter, ",");
-        requireNext(iter, tokens.cend());
-        ++iter;
-        uint8_t to = getOneReg(iter);
-        // 1psd
-        currBlock.bytes.push_back(0x10 | static_cast<uint8_t>(buffer / 4));
-        currBlock.bytes.push_back((from << 4) | to);
-        currPos += 2;
       }
-    } else if (iter->value == "st") {  // st something
-      requireNext(iter, tokens.cend());
-      ++iter;
-      uint8_t from = getOneReg(iter);
+
+      bool usesLabel = false;
+      Value operandValue{0, "", false};
+      if (value == tokens.cend()) {  // sugared offset, or no value at all
+        fields.value = 0;
+      } else {
+        const_iter last = value;
+        operandValue = getExpression(state, last, tokens.cend());
+        usesLabel = form.value.allowLabel && !operandValue.label.empty();
+        if (usesLabel)
+          fields.value = 0x5a5a5a5a;  // magic number - 0x5--- is an invalid
+                                      // opcode
+        else
+          fields.value = getValue(value, last, operandValue, form);
+      }
+
+      uint32_t instructionPos = static_cast<uint32_t>(state.currPos);
+      optional<LabelUse> labelUse;
+      uint32_t addend = static_cast<uint32_t>(operandValue.number);
+      if (usesLabel)
+        labelUse.emplace(
+            instructionPos + static_cast<uint32_t>(valueOffset(form)),
+            operandValue.label, addend, value->lineNo, value->charNo,
+            form.value.pcRelative);
+      state.image.instruction(Instruction{&form, fields}, labelUse,
+                              state.labelBinds);
+      state.currPos += instructionSize(form);
+    } else if (iter->value == ".pos") {  //.pos form
       requireNext(iter, tokens.cend());
       ++iter;
-      expect(iter, ",");
+      state.currPos = getInt(state, iter, tokens.cend());
+      state.image.setPos(static_cast<uint32_t>(state.currPos));
+    } else if (iter->value == ".space" ||
+               iter->value == ".fill") {  // reserved space
+      const const_iter directive = iter;
       requireNext(iter, tokens.cend());
       ++iter;
-      if (iter->value == "(") {  // (rn) or (rb, ri, 4) forms
-        requireNext(iter, tokens.cend());
-        ++iter;
-        uint8_t temp = getOneReg(iter);
-        requireNext(iter, tokens.cend());
-        ++iter;
-        if (iter->value == ")") {  // (rn) form
-          uint8_t to = temp;
-          currBlock.bytes.push_back(0x30 | from);
-          currBlock.bytes.push_back(to);
-        } else {  // (rd, ri, 4) form
-          // 4sdi
-          uint8_t base = temp;
-          expect(iter, ",", ",' or '(");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          uint8_t index = getOneReg(iter);
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ",");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, "4");
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ")");
-          currBlock.bytes.push_back(0x40 | from);
-          currBlock.bytes.push_back((base << 4) | index);
-        }
-      } else {  // o(rn) form
-        unsigned long buffer = getNumber(iter);
-        if (buffer % 4 != 0)
-          throw ParseError(iter->lineNo, iter->charNo,
-                           iter->value + " must be divisible by four.");
-        if (buffer / 4 > 0xf)
-          throw ParseError(iter->lineNo, iter->charNo,
-                           "out of range: a quarter of " + iter->value +
-                               " must fit in 1 nibble.");
-        requireNext(iter, tokens.cend());
-        ++iter;
-        expect(iter, "(");
+      uint64_t count = getNumber(state, iter, tokens.cend());
+      uint8_t value = 0;
+      if (directive->value == ".fill") {
         requireNext(iter, tokens.cend());
         ++iter;
-        uint8_t to = getOneReg(iter);
+        expect(iter, ",");
         requireNext(iter, tokens.cend());
         ++iter;
-        expect(iter, ")");
-        // 3spd
-        currBlock.bytes.push_back(0x30 | from);
-        currBlock.bytes.push_back(((static_cast<uint8_t>(buffer / 4)) << 4) |
-                                  to);
-      }
-      currPos += 2;
-    } else if (iter->value == "halt") {  // halt terminal
-      currBlock.bytes.push_back(0xf0);
-      currBlock.bytes.push_back(0x00);
-      currPos += 2;
-    } else if (iter->value == "nop") {  // nop terminal
-      currBlock.bytes.push_back(0xff);
-      currBlock.bytes.push_back(0x00);
-      currPos += 2;
-    } else if (iter->value == "mov") {  // mov binop
-      currBlock.bytes.push_back(0x60);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getTwoRegs(iter, tokens.cend()));
-      currPos += 2;
-    } else if (iter->value == "add") {  // add binop
-      currBlock.bytes.push_back(0x61);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getTwoRegs(iter, tokens.cend()));
-      currPos += 2;
-    } else if (iter->value == "and") {  // and binop
-      currBlock.bytes.push_back(0x62);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getTwoRegs(iter, tokens.cend()));
-      currPos += 2;
-    } else if (iter->value == "inc") {  // inc unop
-      currBlock.bytes.push_back(0x63);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getOneReg(iter));
-      currPos += 2;
-    } else if (iter->value == "inca") {  // unca unop
-      currBlock.bytes.push_back(0x64);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getOneReg(iter));
-      currPos += 2;
-    } else if (iter->value == "dec") {  // dec unop
-      currBlock.bytes.push_back(0x65);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getOneReg(iter));
-      currPos += 2;
-    } else if (iter->value == "deca") {  // deca unop
-      currBlock.bytes.push_back(0x66);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getOneReg(iter));
-      currPos += 2;
-    } else if (iter->value == "not") {  // not unop
-      currBlock.bytes.push_back(0x67);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(getOneReg(iter));
-      currPos += 2;
-    } else if (iter->value == "shl") {  // shl sh* form
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, "$");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      unsigned long buffer = getNumber(iter);
-      if (buffer > 0x7f) {
-        throw ParseError(
-            iter->lineNo, iter->charNo,
-            "out of range: " + iter->value + " must fit in 1 byte.");
-      }
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, ",");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(0x70 | getOneReg(iter));
-      currBlock.bytes.push_back(static_cast<uint8_t>(buffer));
-      currPos += 2;
-    } else if (iter->value == "shr") {  // shr sh* form
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, "$");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      unsigned long buffer = getNumber(iter);
-      if (buffer > 0x80) {
-        throw ParseError(
-            iter->lineNo, iter->charNo,
-            "out of range: " + iter->value + " must fit in 1 byte.");
-      }
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, ",");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(0x70 | getOneReg(iter));
-      currBlock.bytes.push_back(static_cast<uint8_t>(-buffer));
-      currPos += 2;
-    } else if (iter->value == "br") {  // br form
-      requireNext(iter, tokens.cend());
-      ++iter;
-      if (validLabel(iter->value)) {
-        currBlock.bytes.push_back(0x80);
-        currBlock.bytes.push_back(0x5a);
-        labelUses.push_back(LabelUse(currPos + 1, iter->value, iter->lineNo,
-                                     iter->charNo, true));
-      } else {
-        long buffer = getNumberSigned(iter);
-        if (buffer % 2 != 0) {
-          throw ParseError(iter->lineNo, iter->charNo,
-                           iter->value + " must be divisible by two.");
-        } else if (buffer / 2 > 0x7f || buffer / 2 < -0x80) {
-          throw ParseError(
-              iter->lineNo, iter->charNo,
-              "out of range: half of " + iter->value + " must fit in 1 byte.");
-        }
-        currBlock.bytes.push_back(0x80);
-        currBlock.bytes.push_back(
-            static_cast<uint8_t>(static_cast<int8_t>(buffer / 2)));
+        const const_iter first = iter;
+        unsigned long buffer = getNumber(state, iter, tokens.cend());
+        if (buffer > numeric_limits<uint8_t>::max())
+          throw ParseError(first->lineNo, first->charNo,
+                           "out of range: " + textOf(first, iter) +
+                               " must fit in 1 byte.");
+        value = static_cast<uint8_t>(buffer);
       }
-      currPos += 2;
-    } else if (iter->value == "beq") {  // beq form
+      reserve(state, directive, count);
+      state.image.fill(value, count);
+      state.currPos += count;
+    } else if (iter->value == ".align") {
+      const const_iter directive = iter;
       requireNext(iter, tokens.cend());
       ++iter;
-      currBlock.bytes.push_back(0x90 | getOneReg(iter));
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, ",");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      if (validLabel(iter->value)) {
-        currBlock.bytes.push_back(0x5a);
-        labelUses.push_back(LabelUse(currPos + 1, iter->value, iter->lineNo,
-                                     iter->charNo, true));
-      } else {
-        long buffer = getNumberSigned(iter);
-        if (buffer % 2 != 0) {
-          throw ParseError(iter->lineNo, iter->charNo,
-                           iter->value + " must be divisible by two.");
-        } else if (buffer / 2 > 0x7f || buffer / 2 < -0x80) {
-          throw ParseError(
-              iter->lineNo, iter->charNo,
-              "out of range: half of " + iter->value + " must fit in 1 byte.");
-        }
-        currBlock.bytes.push_back(
-            static_cast<uint8_t>(static_cast<int8_t>(buffer / 2)));
+      const const_iter first = iter;
+      uint32_t alignment = getInt(state, iter, tokens.cend());
+      if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        throw ParseError(first->lineNo, first->charNo,
+                         textOf(first, iter) + " must be a power of two.");
+      pad(state, directive, alignment);
+    } else if (iter->value == ".jumptable") {  // addresses of labels
+      const const_iter directive = iter;
+      pad(state, directive, 4);
+      for (bool more = true; more;) {
+        requireNext(iter, tokens.cend());
+        ++iter;
+        const const_iter first = iter;
+        Value address = getExpression(state, iter, tokens.cend());
+        if (address.label.empty())
+          throw ParseError(first->lineNo, first->charNo,
+                           "expected label, but got '" + textOf(first, iter) +
+                               "'.");
+        emitAddress(state, directive, first, address);
+        more = iter + 1 != tokens.cend() && (iter + 1)->value == ",";
+        if (more) ++iter;
       }
-      currPos += 2;
-    } else if (iter->value == "bgt") {  // bgt form
+    } else if (iter->value == ".equ") {  // named constant
       requireNext(iter, tokens.cend());
       ++iter;
-      currBlock.bytes.push_back(0xa0 | getOneReg(iter));
+      const const_iter name = iter;
+      defineConstant(state, iter, tokens.cend());
+      // worked out now, so any errors in it show up in order
+      constantValue(state, constantsOf(state).at(name->value), name);
+    } else if (iter->value == ".rept") {  // repeated block
+      const const_iter directive = iter;
       requireNext(iter, tokens.cend());
       ++iter;
-      expect(iter, ",");
+      state.rept = Rept{*directive, getNumber(state, iter, tokens.cend()), 1,
+                        {}};
+    } else if (iter->value == ".incbin") {  // contents of a file
+      const const_iter directive = iter;
       requireNext(iter, tokens.cend());
       ++iter;
-      if (validLabel(iter->value)) {
-        currBlock.bytes.push_back(0x5a);
-        labelUses.push_back(LabelUse(currPos + 1, iter->value, iter->lineNo,
-                                     iter->charNo, true));
-      } else {
-        long buffer = getNumberSigned(iter);
-        if (buffer % 2 != 0) {
-          throw ParseError(iter->lineNo, iter->charNo,
-                           iter->value + " must be divisible by two.");
-        } else if (buffer / 2 > 0x7f || buffer / 2 < -0x80) {
-          throw ParseError(
-              iter->lineNo, iter->charNo,
-              "out of range: half of " + iter->value + " must fit in 1 byte.");
-        }
-        currBlock.bytes.push_back(
-            static_cast<uint8_t>(static_cast<int8_t>(buffer / 2)));
+      const const_iter path = iter;
+      if (path->value.size() < 2 || path->value.front() != '"')
+        throw ParseError(path->lineNo, path->charNo,
+                         "expected file name in quotes, but got '" +
+                             path->value + "'.");
+      string pathName = path->value.substr(1, path->value.size() - 2);
+      shared_ptr<const MappedFile> file;
+      try {
+        file = make_shared<const MappedFile>(pathName);
+      } catch (const FileOpenError&) {
+        throw ParseError(path->lineNo, path->charNo,
+                         "could not open '" + pathName + "'.");
       }
-      currPos += 2;
-    } else if (iter->value == "gpc") {  // gpc form
-      currBlock.bytes.push_back(0x6F);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, "$");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      unsigned long buffer = getNumber(iter);
-      if (buffer % 2 != 0)
-        throw ParseError(iter->lineNo, iter->charNo,
-                         iter->value + " must be divisible by two.");
-      else if (buffer / 2 > 0xf)
-        throw ParseError(
-            iter->lineNo, iter->charNo,
-            "out of range: half of " + iter->value + " must fit in 1 nibble.");
 
-      requireNext(iter, tokens.cend());
-      ++iter;
-      expect(iter, ",");
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock.bytes.push_back(
-          static_cast<uint8_t>(((buffer / 2) << 4) | getOneReg(iter)));
-      currPos += 2;
-    } else if (iter->value == "j") {  // j form
-      requireNext(iter, tokens.cend());
-      ++iter;
-      if (iter->value == "*") {
-        requireNext(iter, tokens.cend());
-        ++iter;
-        if (iter->value == "(") {
-          requireNext(iter, tokens.cend());
-          ++iter;
-          uint8_t temp = getOneReg(iter);
-          requireNext(iter, tokens.cend());
-          ++iter;
-          if (iter->value == ")") {
-            // j * ( rd )
-            currBlock.bytes.push_back(0xd0 | temp);
-            currBlock.bytes.push_back(0x0);
-          } else {
-            // j * ( rd , ri , 4 )
-            uint8_t base = temp;
-            expect(iter, ",", ",' or '(");
-            requireNext(iter, tokens.cend());
-            ++iter;
-            uint8_t index = getOneReg(iter);
-            requireNext(iter, tokens.cend());
-            ++iter;
-            expect(iter, ",");
-            requireNext(iter, tokens.cend());
-            ++iter;
-            expect(iter, "4");
-            requireNext(iter, tokens.cend());
-            ++iter;
-            expect(iter, ")");
-            currBlock.bytes.push_back(0xe0 | base);
-            currBlock.bytes.push_back(index << 4);
-          }
-        } else {
-          // j * o ( rd )
-          unsigned long buffer = getNumber(iter);
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, "(");
-          uint8_t rd = getOneReg(iter);
-          requireNext(iter, tokens.cend());
-          ++iter;
-          expect(iter, ")");
-          currBlock.bytes.push_back(0xd0 | rd);
-          if (buffer % 4 != 0)
-            throw ParseError(iter->lineNo, iter->charNo,
-                             iter->value + " must be divisible by four.");
-          else if (buffer / 4 > 0xff)
-            throw ParseError(iter->lineNo, iter->charNo,
-                             "out of range: a quarter of " + iter->value +
-                                 " must fit in 1 byte.");
-          currBlock.bytes.push_back(static_cast<uint8_t>(buffer));
-        }
-      } else if (iter->value == "(") {
-        // j ( rd )
-        requireNext(iter, tokens.cend());
+      uint64_t offset = 0;
+      uint64_t length = file->size();
+      if (iter + 1 != tokens.cend() && (iter + 1)->value == ",") {
         ++iter;
-        uint8_t rd = getOneReg(iter);
         requireNext(iter, tokens.cend());
         ++iter;
-        expect(iter, ")");
-        currBlock.bytes.push_back(0xc0 | rd);
-        currBlock.bytes.push_back(0x0);
-      } else {
-        if (iter + 1 != tokens.cend() &&
-            (iter + 1)->value == "(") {  // j o ( rd )
-          requireNext(iter, tokens.cend());
-          ++iter;
-          unsigned long buffer = getNumber(iter);
-          requireNext(iter, tokens.cend());
+        const const_iter first = iter;
+        offset = getNumber(state, iter, tokens.cend());
+        if (offset > file->size())
+          throw ParseError(first->lineNo, first->charNo,
+                           "offset " + textOf(first, iter) +
+                               " is past the end of '" + pathName + "'.");
+        length = file->size() - offset;
+        if (iter + 1 != tokens.cend() && (iter + 1)->value == ",") {
           ++iter;
-          expect(iter, "(");
-          uint8_t rd = getOneReg(iter);
           requireNext(iter, tokens.cend());
           ++iter;
-          expect(iter, ")");
-          currBlock.bytes.push_back(0xc0 | rd);
-          if (buffer % 2 != 0)
-            throw ParseError(iter->lineNo, iter->charNo,
-                             iter->value + " must be divisible by two.");
-          else if (buffer / 2 > 0xff)
-            throw ParseError(iter->lineNo, iter->charNo,
-                             "out of range: half of " + iter->value +
-                                 " must fit in 1 byte.");
-          currBlock.bytes.push_back(static_cast<uint8_t>(buffer));
-        } else {
-          // requireNext(iter, tokens.cend());
-          // ++iter;
-          currBlock.bytes.push_back(0xb0);
-          currBlock.bytes.push_back(0x0);
-          uint32_t address;
-          if (validLabel(iter->value)) {
-            address = 0x5a5a5a5a;  // magic number - 0x5--- is an invalid opcode
-            labelUses.push_back(LabelUse(currPos + 2, iter->value, iter->lineNo,
-                                         iter->charNo, false));
-          } else {
-            address = getInt(iter);
-          }
-          addInt(address, currBlock);
-          currPos += 4;
-          // j const
+          const const_iter lengthFirst = iter;
+          length = getNumber(state, iter, tokens.cend());
+          if (length > file->size() - offset)
+            throw ParseError(lengthFirst->lineNo, lengthFirst->charNo,
+                             "length " + textOf(lengthFirst, iter) +
+                                 " runs past the end of '" + pathName + "'.");
         }
       }
-      currPos += 2;
-    } else if (iter->value == ".pos") {  //.pos form
-      blocks.push_back(currBlock);
-      requireNext(iter, tokens.cend());
-      ++iter;
-      currBlock = Block();
-      currBlock.startPos = getInt(iter);
-      currPos = currBlock.startPos;
+      reserve(state, directive, length);
+      state.image.include(file, offset, length);
+      state.currPos += length;
     } else if (iter->value == ".long" ||
                iter->value == ".data") {  // literal data
+      const const_iter directive = iter;
       requireNext(iter, tokens.cend());
       ++iter;
-      if (validLabel(iter->value))
-        labelUses.push_back(
-            LabelUse(currPos, iter->value, iter->lineNo, iter->charNo, false));
-      else
-        addInt(getInt(iter), currBlock);
-      currPos += 4;
+      const const_iter first = iter;
+      Value word = getExpression(state, iter, tokens.cend());
+      if (!word.label.empty()) {
+        emitAddress(state, directive, first, word);
+      } else {
+        uint32_t number = intOf(first, iter, word);
+        reserve(state, directive, 4);
+        state.image.word(number, {}, state.labelBinds);
+        state.currPos += 4;
+      }
     } else if (validLabel(iter->value,
                           true)) {  // label binding
+      // labels before a .jumptable name the table, even on lines of their
+      // own, so it's aligned first
+      if (iter >= labelsEnd) {
+        labelsEnd = iter + 1;
+        while (labelsEnd != tokens.cend() &&
+               (validLabel(labelsEnd->value, true) || labelsEnd->value == "\n"))
+          ++labelsEnd;
+        if (labelsEnd != tokens.cend() && labelsEnd->value == ".jumptable")
+          pad(state, labelsEnd, 4);
+      }
+
       // add label to labelBinds
       string labelName = iter->value.substr(0, iter->value.length() - 1);
-      if (labelBinds.find(labelName) == labelBinds.end())
-        labelBinds.insert(pair<string, uint32_t>(labelName, currPos));
-      else
+      if (state.currPos > numeric_limits<uint32_t>::max())
+        throw ParseError(iter->lineNo, iter->charNo,
+                         "label '" + labelName + "' is past end of memory.");
+      if (constantsOf(state).count(labelName) != 0)
+        throw ParseError(iter->lineNo, iter->charNo,
+                         "cannot reuse constant '" + labelName + "'.");
+      if (!state.labelBinds
+               .emplace(labelName, static_cast<uint32_t>(state.currPos))
+               .second)
         throw ParseError(iter->lineNo, iter->charNo,
                          "cannot reuse label '" + labelName + "'.");
+      state.image.bind(labelName, static_cast<uint32_t>(state.currPos));
       continue;  // labels don't have to have a newline after them.
     } else if (iter->value == "\n") {
       continue;  // ignore extraneous newlines.
@@ -747,12 +1684,420 @@ vector<uint8_t> generateBinary(const vector<Token>& tokens) {
       }
     }
   }
+}
+
+// the value field of statement idx, whose value is a label used at useLocn
+uint32_t symbolValue(const Program& program, size_t idx,
+                     const vector<uint64_t>& symbolPos, uint64_t useLocn,
+                     bool isPCRel) {
+  const Program::SymbolUse& use = program.symbolUses[program.values[idx]];
+  auto labelUse = [&]() {
+    return LabelUse(static_cast<uint32_t>(useLocn),
+                    string(program.symbols[use.symbol]), use.addend,
+                    program.lines[idx], use.charNo, isPCRel);
+  };
+  if (symbolPos[use.symbol] == MEMORY_SIZE) unboundLabel(labelUse());
+  uint32_t target = static_cast<uint32_t>(symbolPos[use.symbol]) + use.addend;
+  if (!isPCRel) return target;
+
+  long diff = static_cast<long>(target) - (static_cast<long>(useLocn) + 1);
+  if (diff % 2 != 0 || diff / 2 > 0x7f || diff / 2 < -0x80) {
+    uint8_t unused;
+    resolve(labelUse(), target - use.addend, &unused);  // throws
+  }
+  return static_cast<uint32_t>(diff / 2);
+}
+
+// Lays out a parsed program, then encodes it in one pass, with every label's
+// address already known - so label uses inside chunks can be finished off as
+// soon as they're written.
+void place(Image& image, const Program& program) {
+  vector<uint64_t> starts = layout(program);
+  vector<uint64_t> symbolPos(program.symbols.size(), MEMORY_SIZE);
+  // only label uses inside chunks look labels up by name
+  bool chunksUseLabels =
+      any_of(program.chunks.begin(), program.chunks.end(),
+             [](const Program::Chunk& chunk) { return !chunk.uses.empty(); });
+  LabelBinds labelBinds;
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    if (program.ops[idx] != Program::LABEL) continue;
+    symbolPos[program.values[idx]] = starts[idx];
+    if (chunksUseLabels)
+      labelBinds.emplace(program.symbols[program.values[idx]],
+                         static_cast<uint32_t>(starts[idx]));
+  }
+
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    uint8_t op = program.ops[idx];
+    uint32_t value = program.values[idx];
+    bool isSymbolic = (op & Program::SYMBOLIC) != 0;
+    switch (op & ~Program::SYMBOLIC) {
+      case Program::LABEL:
+        break;
+      case Program::POS:
+        image.setPos(value);
+        break;
+      case Program::LONG: {
+        uint8_t bytes[4];
+        putInt(isSymbolic
+                   ? symbolValue(program, idx, symbolPos, starts[idx], false)
+                   : value,
+               bytes);
+        image.write(bytes, 4);
+        break;
+      }
+      case Program::BYTES: {
+        const Program::Chunk& chunk = program.chunks[value];
+        image.write(chunk.bytes.data(), chunk.bytes.size());
+        for (LabelUse labelUse : chunk.uses) {
+          labelUse.useLocn += static_cast<uint32_t>(starts[idx]);
+          image.use(labelUse, labelBinds);
+        }
+        break;
+      }
+      case Program::FILL:
+        image.fill(program.fills[value].value, program.fills[value].count);
+        break;
+      case Program::INCLUDE: {
+        const Program::Include& include = program.includes[value];
+        image.write(include.data(), include.size);
+        break;
+      }
+      case Program::ALIGN:
+        image.align(value, statementSize(program, idx, starts[idx]));
+        break;
+      default: {
+        const InstructionForm& form = formOf(program, idx);
+        Fields fields = fieldsOf(program, idx);
+        if (isSymbolic)
+          fields.value = symbolValue(program, idx, symbolPos,
+                                     starts[idx] + valueOffset(form),
+                                     form.value.pcRelative);
+        uint8_t encoded[6];
+        encode(form, fields, encoded);
+        image.write(encoded, instructionSize(form));
+        break;
+      }
+    }
+  }
+}
+
+// Parses a whole program. Differences with labels bound after them count as 0
+// the first time through; if there were any, it's parsed again with every
+// label's address known. Nothing the layout depends on can use those, so the
+// first time binds each label where it's placed.
+Program assembleProgram(const vector<Token>& tokens,
+                        memory_resource* resource) {
+  Program program(resource);
+  ProgramImage image(program);
+  Assembler state{image, 0, {}, {}, {}, nullptr, true, false, nullptr};
+  assemble(state, tokens);
+  checkComplete(state);
+  if (!state.isEstimated) return program;
+
+  Program again(resource);
+  ProgramImage againImage(again);
+  Assembler second{againImage,
+                   0,
+                   {},
+                   {},
+                   {},
+                   &state.labelBinds,
+                   false,
+                   false,
+                   nullptr};
+  assemble(second, tokens);
+  return again;
+}
+}  // namespace
+
+ParseError::ParseError(unsigned l, unsigned c, string m) noexcept
+    : lineNo{l},
+      charNo{c},
+      detail{m},
+      msg{to_string(l) + ":" + to_string(c) + ":" + m} {}
+const char* ParseError::what() const noexcept { return msg.c_str(); }
+unsigned ParseError::line() const noexcept { return lineNo; }
+unsigned ParseError::column() const noexcept { return charNo; }
+const string& ParseError::message() const noexcept { return detail; }
+
+vector<uint8_t> generateBinary(const vector<Token>& tokens) {
+  return placeProgram(parseProgram(tokens));
+}
+
+Program::Program(memory_resource* r) noexcept
+    : ops{r},
+      registers{r},
+      values{r},
+      lines{r},
+      symbols{r},
+      symbolUses{r},
+      chunks{r},
+      fills{r},
+      includes{r},
+      differences{r} {}
+const uint8_t* Program::Include::data() const noexcept {
+  return file->data() + offset;
+}
+memory_resource* Program::resource() const noexcept {
+  return ops.get_allocator().resource();
+}
+void Program::push(uint8_t op, uint16_t registerFields, uint32_t value,
+                   uint32_t line) {
+  ops.push_back(op);
+  registers.push_back(registerFields);
+  values.push_back(value);
+  lines.push_back(line);
+}
+
+uint16_t packRegisters(const Fields& fields) noexcept {
+  return static_cast<uint16_t>(fields.s << 12 | fields.d << 8 |
+                               fields.b << 4 | fields.i);
+}
+Fields fieldsOf(const Program& program, size_t idx) noexcept {
+  uint16_t packed = program.registers[idx];
+  return Fields{static_cast<uint8_t>(packed >> 12 & 0xf),
+                static_cast<uint8_t>(packed >> 8 & 0xf),
+                static_cast<uint8_t>(packed >> 4 & 0xf),
+                static_cast<uint8_t>(packed & 0xf), program.values[idx]};
+}
+const InstructionForm& formOf(const Program& program, size_t idx) noexcept {
+  return INSTRUCTION_FORMS[static_cast<uint8_t>(program.ops[idx] &
+                                                ~Program::SYMBOLIC)];
+}
+bool isInstruction(const Program& program, size_t idx) noexcept {
+  return (program.ops[idx] & ~Program::SYMBOLIC) < INSTRUCTION_FORMS.size();
+}
+
+Program parseProgram(const vector<Token>& tokens, memory_resource* resource) {
+  return assembleProgram(tokens, resource);
+}
+uint64_t statementSize(const Program& program, size_t idx, uint64_t pos) {
+  uint32_t value = program.values[idx];
+  switch (program.ops[idx] & ~Program::SYMBOLIC) {
+    case Program::LABEL:
+    case Program::POS:
+      return 0;
+    case Program::LONG:
+      return 4;
+    case Program::BYTES:
+      return program.chunks[value].bytes.size();
+    case Program::FILL:
+      return program.fills[value].count;
+    case Program::INCLUDE:
+      return program.includes[value].size;
+    case Program::ALIGN:
+      return (value - pos % value) % value;
+    default:
+      return instructionSize(formOf(program, idx));
+  }
+}
+vector<uint64_t> layout(const Program& program) {
+  vector<uint64_t> starts(program.ops.size());
+  uint64_t currPos = 0;
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    if (program.ops[idx] == Program::POS) currPos = program.values[idx];
+    starts[idx] = currPos;
+    currPos += statementSize(program, idx, currPos);
+  }
+  return starts;
+}
+vector<uint8_t> placeProgram(const Program& program) {
+  PagedImage image;
+  place(image, program);
+  return image.finish();
+}
+void checkProgram(const Program& program) {
+  CheckingImage image;
+  place(image, program);
+  image.finish();
+}
+void writeProgram(const Program& program, const string& fileName) {
+  PagedImage image;
+  place(image, program);
+
+  ofstream fout;
+  fout.open(fileName, ios_base::binary | ios_base::trunc | ios_base::out);
+  if (!fout.is_open()) throw FileOpenError();
+  image.finish(fout, true);
+}
+void writeProgram(const Program& program, ostream& out) {
+  PagedImage image;
+  place(image, program);
+  image.finish(out, false);  // out may be appended to, or not start at 0
+}
+optional<Mismatch> verifyProgram(const Program& program,
+                                 const uint8_t* expected, uint64_t size) {
+  checkProgram(program);  // errors in the source aren't differences
+  vector<uint64_t> starts = layout(program);
+  auto endOf = [&](size_t idx) {
+    return starts[idx] + statementSize(program, idx, starts[idx]);
+  };
+  auto lineAt = [&](uint64_t address) {  // later statements overwrite earlier
+    for (size_t idx = program.ops.size(); idx-- > 0;)
+      if (starts[idx] <= address && address < endOf(idx))
+        return program.lines[idx];
+    return uint32_t{0};
+  };
+
+  // what the program covers, merged where statements follow each other
+  vector<pair<uint64_t, uint64_t>> extents;
+  uint64_t end = 0;
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    end = max(end, endOf(idx));
+    if (endOf(idx) == starts[idx]) continue;
+    if (!extents.empty() && extents.back().second == starts[idx])
+      extents.back().second = endOf(idx);
+    else
+      extents.emplace_back(starts[idx], endOf(idx));
+  }
+  if (end != size) return Mismatch{min(end, size), lineAt(min(end, size))};
 
-  blocks.push_back(currBlock);
+  sort(extents.begin(), extents.end());
+  bool overlaps = false;
+  uint64_t covered = 0;
+  for (const auto& extent : extents) {
+    overlaps = overlaps || extent.first < covered;
+    auto nonzero =
+        find_if(expected + covered, expected + max(covered, extent.first),
+                [](uint8_t byte) { return byte != 0; });
+    if (nonzero != expected + max(covered, extent.first))
+      return Mismatch{static_cast<uint64_t>(nonzero - expected), 0};
+    covered = max(covered, extent.second);
+  }
 
-  vector<uint8_t> result = bytesFromBlocks(blocks);  // final processing steps
-  replacePlaceholders(result, labelBinds, labelUses);
+  if (overlaps) {  // only the final bytes can be compared
+    vector<uint8_t> bytes = placeProgram(program);
+    auto found = mismatch(bytes.begin(), bytes.end(), expected);
+    if (found.first == bytes.end()) return {};
+    uint64_t address = static_cast<uint64_t>(found.first - bytes.begin());
+    return Mismatch{address, lineAt(address)};
+  }
 
+  try {
+    VerifyingImage image(expected, size);
+    place(image, program);
+    image.finish();
+  } catch (Mismatch& found) {
+    found.lineNo = lineAt(found.address);
+    return found;
+  }
+  return {};
+}
+
+uint64_t LineCode::size() const noexcept { return bytes.size() + fillCount; }
+
+const PagedMemory::Page PagedMemory::ZERO_PAGE{};
+
+PagedMemory::PagedMemory() noexcept : lastPage{nullptr}, lastIndex{0} {}
+void PagedMemory::put(uint64_t pos, const uint8_t* bytes, size_t count) {
+  while (count != 0) {
+    uint64_t offset = pos % PAGE_SIZE;
+    size_t chunk = min<uint64_t>(count, PAGE_SIZE - offset);
+    copy(bytes, bytes + chunk, page(pos / PAGE_SIZE).data() + offset);
+    pos += chunk;
+    bytes += chunk;
+    count -= chunk;
+  }
+}
+void PagedMemory::fill(uint64_t pos, uint8_t value, uint64_t count) {
+  uint64_t end = pos + count;
+  if (value == 0) {  // only pages already allocated need it
+    for (auto iter = pages.lower_bound(pos / PAGE_SIZE);
+         iter != pages.end() && iter->first * PAGE_SIZE < end; ++iter) {
+      uint64_t base = iter->first * PAGE_SIZE;
+      uint64_t from = max(pos, base);
+      fill_n(iter->second->data() + (from - base),
+             min(end, base + PAGE_SIZE) - from, 0);
+    }
+    return;
+  }
+  while (pos < end) {
+    uint64_t offset = pos % PAGE_SIZE;
+    uint64_t chunk = min(end - pos, PAGE_SIZE - offset);
+    fill_n(page(pos / PAGE_SIZE).data() + offset, chunk, value);
+    pos += chunk;
+  }
+}
+vector<uint8_t> PagedMemory::read(uint64_t size) const {
+  vector<uint8_t> result(size);
+  for (const auto& entry : pages) {
+    uint64_t base = entry.first * PAGE_SIZE;
+    if (base >= size) break;
+    const uint8_t* bytes = entry.second->data();
+    copy(bytes, bytes + min(PAGE_SIZE, size - base), result.data() + base);
+  }
   return result;
 }
+void PagedMemory::write(ostream& out, uint64_t size, bool seekable) const {
+  uint64_t pos = 0;
+  auto skipTo = [&](uint64_t target) {
+    if (seekable && pos < target) {
+      out.seekp(static_cast<streamoff>(target));
+      pos = target;
+    }
+    for (; pos < target; pos += PAGE_SIZE)
+      out.write(reinterpret_cast<const char*>(ZERO_PAGE.data()),
+                static_cast<streamsize>(min(PAGE_SIZE, target - pos)));
+    pos = target;
+  };
+  for (const auto& entry : pages) {
+    uint64_t base = entry.first * PAGE_SIZE;
+    if (base >= size) break;
+    uint64_t count = min(PAGE_SIZE, size - base);
+    skipTo(base);
+    out.write(reinterpret_cast<const char*>(entry.second->data()),
+              static_cast<streamsize>(count));
+    pos += count;
+  }
+  if (seekable && pos < size) {  // a seek alone doesn't make the file longer
+    skipTo(size - 1);
+    out.put(0);
+  }
+  skipTo(size);
+  out.flush();
+}
+PagedMemory::Page& PagedMemory::page(uint64_t index) {
+  if (lastPage != nullptr && lastIndex == index) return *lastPage;
+  unique_ptr<Page>& slot = pages[index];
+  if (slot == nullptr) slot = make_unique<Page>();
+  lastPage = slot.get();
+  lastIndex = index;
+  return *slot;
+}
+
+LineCode assembleLine(const vector<Token>& tokens) {
+  LineCode code{};
+  LineImage image(code);
+  Assembler state{image, 0, {}, {}, {}, nullptr, false, false, nullptr};
+  assemble(state, tokens);
+  checkComplete(state);
+  auto first = find_if(tokens.cbegin(), tokens.cend(), [](const Token& token) {
+    return !validLabel(token.value, true);
+  });
+  code.alignsLabels = first != tokens.cend() && first->value == ".jumptable";
+  return code;
+}
+
+void streamBinary(istream& source, const string& destination,
+                  size_t fixupBudget) {
+  ofstream fout;
+  fout.open(destination, ios_base::binary | ios_base::trunc | ios_base::out);
+  if (!fout.is_open()) throw FileOpenError();
+
+  StreamedImage image(fout, fixupBudget);
+  Assembler state{image, 0, {}, {}, {}, nullptr, false, false, nullptr};
+  vector<Token> line;  // lines with nothing but labels wait for the next one
+  for (unsigned lineNo = 1; tokenizeLine(source, lineNo, line); lineNo++) {
+    if (all_of(line.cbegin(), line.cend(), [](const Token& token) {
+          return token.value == "\n" || validLabel(token.value, true);
+        }))
+      continue;  // so a .jumptable on the next line can align them
+    assemble(state, line);
+    line.clear();
+  }
+  assemble(state, line);
+  checkComplete(state);
+  image.finish(state.labelBinds);
+}
 }  // namespace sm213assemble::model
\ No newline at end of file
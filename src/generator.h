@@ -18,18 +18,38 @@
 #ifndef SM213ASSEMBLE_MODEL_GENERATOR_H_
 #define SM213ASSEMBLE_MODEL_GENERATOR_H_
 
+#include "instructions.h"
 #include "io.h"
 
+#include <array>
 #include <fstream>
+#include <istream>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
+#include <string>
 #include <vector>
 
 namespace sm213assemble::model {
 namespace {
+using sm213assemble::io::MappedFile;
 using sm213assemble::io::Token;
+using std::array;
 using std::exception;
+using std::istream;
+using std::map;
 using std::ofstream;
+using std::optional;
+using std::ostream;
+using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::vector;
+using std::pmr::get_default_resource;
+using std::pmr::memory_resource;
+namespace pmr = std::pmr;
 }  // namespace
 
 class ParseError : public exception {
@@ -41,29 +61,246 @@ class ParseError : public exception {
 
   const char* what() const noexcept override;
 
+  // the parts of what() on their own
+  unsigned line() const noexcept;
+  unsigned column() const noexcept;
+  const string& message() const noexcept;
+
  private:
+  unsigned lineNo;
+  unsigned charNo;
+  string detail;
   string msg;
 };
 
+// a placeholder to fill in once labelName is bound
+struct LabelUse {
+  uint32_t useLocn;
+  bool isPCRel;
+  string labelName;
+  uint32_t addend;  // added to the label's address
+  unsigned labelLine;
+  unsigned labelChar;
+
+  LabelUse(uint32_t useLocn, string labelName, uint32_t addend,
+           unsigned lineNo, unsigned charNo, bool isPCRel) noexcept;
+};
+
+// number of placeholder bytes a label use fills in
+size_t fixupSize(const LabelUse&) noexcept;
+// writes the fixupSize(use) bytes referring to target into out
+void resolve(const LabelUse& use, uint32_t target, uint8_t* out);
+
+// an instruction as the encoder sees it
+struct Instruction {
+  const InstructionForm* form;
+  Fields fields;  // value is a placeholder if the instruction uses a label
+};
+
 vector<uint8_t> generateBinary(const vector<Token>&);
+// A parsed program, as parallel arrays with one entry per statement, so that
+// passes can scan it without decoding bytes. Instructions take 11 bytes each;
+// label uses, and statements too big for the arrays, keep the rest of what
+// they need in side tables. Labels are statements of their own, bound where
+// they appear. The arrays and tables, and the chunks in them, come from the
+// given memory resource - only label names in chunk label uses that are too
+// long for the small-string buffer, and files mapped for includes, don't.
+struct Program {
+  // ops past the instruction forms
+  enum Op : uint8_t {
+    LABEL = 0x40,  // value is a symbol
+    POS,           // value is the position
+    LONG,          // value is the word
+    BYTES,         // value indexes chunks
+    FILL,          // value indexes fills
+    ALIGN,         // value is the alignment
+    INCLUDE,       // value indexes includes
+  };
+  // set on an INSTRUCTION_FORMS index or LONG whose value is a label - the
+  // value then indexes symbolUses
+  static constexpr uint8_t SYMBOLIC = 0x80;
+
+  struct SymbolUse {
+    uint32_t symbol;
+    uint32_t addend;  // added to the label's address
+    unsigned charNo;  // of the label, for errors
+  };
+  // an instruction in a chunk from a .rept body
+  struct ChunkInstruction {
+    uint32_t offset;  // into the chunk's bytes
+    uint32_t line;
+    uint8_t op;  // an INSTRUCTION_FORMS index
+  };
+  struct Chunk {
+    pmr::vector<uint8_t> bytes;
+    pmr::vector<LabelUse> uses;  // useLocn is counted from the start of bytes
+    pmr::vector<ChunkInstruction> instructions;  // in order
+  };
+  struct Fill {
+    uint64_t count;
+    uint8_t value;
+  };
+  // bytes of an .incbin, left in the file they're mapped from until placed
+  struct Include {
+    shared_ptr<const MappedFile> file;
+    uint64_t offset;
+    uint64_t size;
+
+    const uint8_t* data() const noexcept;
+  };
+  // labels subtracted from each other - a number once parsed, so what's
+  // between them has to stay as it is
+  struct Difference {
+    uint32_t to;    // symbol
+    uint32_t from;  // symbol
+  };
+
+  explicit Program(memory_resource* resource = get_default_resource()) noexcept;
+
+  pmr::vector<uint8_t> ops;         // an INSTRUCTION_FORMS index, or an Op
+  pmr::vector<uint16_t> registers;  // s, d, b, and i, a nibble each
+  pmr::vector<uint32_t> values;
+  pmr::vector<uint32_t> lines;
+
+  pmr::vector<pmr::string> symbols;  // label names, by symbol
+  pmr::vector<SymbolUse> symbolUses;
+  pmr::vector<Chunk> chunks;
+  pmr::vector<Fill> fills;
+  pmr::vector<Include> includes;
+  pmr::vector<Difference> differences;
+
+  memory_resource* resource() const noexcept;
+  void push(uint8_t op, uint16_t registers, uint32_t value, uint32_t line);
+};
+uint16_t packRegisters(const Fields&) noexcept;
+// fields of an instruction statement, with its value as is
+Fields fieldsOf(const Program&, size_t idx) noexcept;
+const InstructionForm& formOf(const Program&, size_t idx) noexcept;
+bool isInstruction(const Program&, size_t idx) noexcept;
+
+Program parseProgram(const vector<Token>&,
+                     memory_resource* resource = get_default_resource());
+// bytes statement idx takes up, if it starts at pos
+uint64_t statementSize(const Program&, size_t idx, uint64_t pos);
+// where each statement starts once the program is laid out
+vector<uint64_t> layout(const Program&);
+// lays out and encodes the program
+vector<uint8_t> placeProgram(const Program&);
+// Throws the ParseError placing the program would, without placing it - only
+// label uses are filled in, one at a time.
+void checkProgram(const Program&);
+// Lays out and encodes the program, then writes it out, or to the named file,
+// page by page. Only the pages something was placed in are ever held. Throws
+// ParseError before anything is written, or FileOpenError.
+void writeProgram(const Program&, const string& fileName);
+void writeProgram(const Program&, ostream& out);
+
+// where an image first differs from what a program assembles to
+struct Mismatch {
+  uint64_t address;
+  unsigned lineNo;  // of the statement placed there, or 0 if none is
+};
+// Compares the program against an expected image of size bytes as it's
+// encoded, stopping at the first difference found. Nothing is kept but the
+// statement being compared, and only programs that overwrite their own bytes
+// are placed in full first. Throws the ParseError placing the program would
+// before comparing anything.
+optional<Mismatch> verifyProgram(const Program&, const uint8_t* expected,
+                                 uint64_t size);
+
+// The address space, in pages that are only allocated once something is
+// written to them. Untouched pages read as zeros.
+class PagedMemory {
+ public:
+  PagedMemory() noexcept;
+  PagedMemory(const PagedMemory&) = delete;
+
+  PagedMemory& operator=(const PagedMemory&) = delete;
+
+  void put(uint64_t pos, const uint8_t* bytes, size_t count);
+  // writes count copies of value - zeros only touch pages already allocated
+  void fill(uint64_t pos, uint8_t value, uint64_t count);
+
+  // the first size bytes, put together from the pages
+  vector<uint8_t> read(uint64_t size) const;
+  // writes the first size bytes without ever holding them whole - seeks over
+  // untouched pages if out is a file of its own, else writes them from one
+  // shared page of zeros
+  void write(ostream& out, uint64_t size, bool seekable) const;
+
+ private:
+  static constexpr uint64_t PAGE_SIZE = 1 << 12;
+  typedef array<uint8_t, PAGE_SIZE> Page;
+  static const Page ZERO_PAGE;
+
+  Page& page(uint64_t index);  // allocated on first use
+
+  map<uint64_t, unique_ptr<Page>> pages;  // by index
+  Page* lastPage;                         // last one used, if any
+  uint64_t lastIndex;
+};
+
+// what a single line assembles to on its own
+struct LineCode {
+  vector<string> labels;     // bound where the line starts
+  optional<uint32_t> pos;    // set by .pos, if the line has one
+  optional<uint32_t> align;  // set by .align - bytes go at the next multiple
+  bool alignsLabels;         // if it starts with .jumptable, so labels before
+                             // it are bound after the alignment instead
+  vector<uint8_t> bytes;     // placed at pos, or where the line starts
+  vector<LabelUse> uses;     // useLocn is counted from the start of bytes
+  uint64_t fillCount;        // of fillValue, after bytes - so a .space never
+  uint8_t fillValue;         // takes up memory
+
+  uint64_t size() const noexcept;
+};
+LineCode assembleLine(const vector<Token>& tokens);
+
+// Assembles source line by line straight into the named file. Memory use is
+// bounded by the label table and at most fixupBudget unresolved label uses -
+// any more than that wait in a temporary file until the end. Since nothing
+// past the current line has been read, .equ constants have to be defined
+// before they're used.
+void streamBinary(istream& source, const string& destination,
+                  size_t fixupBudget);
 
 // AssemblyStatement ::= <LabelStatemet> <DotStatement>
 //                     | <LabelStatemet> <OpcodeStatement>
-// DotStatement ::= .pos <HexLiteral>
-//                | .(long|data) <HexLiteral>
-// HexLiteral ::= any hex literal
+// DotStatement ::= .pos <Expression>
+//                | .(long|data) <Expression>
+//                | .space <Expression> // that many zero bytes
+//                | .fill <Expression> , <Expression [0, 0xff]>
+//                | .align <Expression, power of two>
+//                | .jumptable <Label> [, <Label>]*
+//                  // their addresses, aligned to 4, as are labels before it
+//                | .incbin <String> [, <Expression> [, <Expression>]]
+//                  // a file's bytes, from offset, for length
+//                | .rept <Expression> <newline> <AssemblyStatement>*
+//                  .endr // the statements, repeated that many times
+//                | .equ <Label> , <Expression>
+//                  // a constant, usable anywhere in the source
+// Expression ::= <Product> [(+|-) <Product>]*
+//              // a number, or a label's address plus a number - a label less
+//              // another is a number, but only .long, .data, and instructions
+//              // can use labels bound after them that way, and not when the
+//              // source is streamed or assembled line by line
+// Product ::= <Term> [(*|/) <Term>]*
+// Term ::= <Number> | <Label> | - <Term> | ( <Expression> )
+//        // labels that name a constant stand for its value
+// Number ::= any decimal, hex, or octal literal
+// String ::= "<any characters but a quote>"
 // Label ::= [a-zA-Z_][a-zA-Z_0-9]*
 // LabelStatement ::= <Label> :
 // Register ::= r[0-7]
 // OpCodeStatement ::= ld $<Label> , <Register> // ld immediate using label
-//                   | ld $<HexLiteral (uint)> , <Register> // ld literal
+//                   | ld $<Expression (uint)> , <Register> // ld literal
 //                   | ld ( <Register> ) , <Register> // ld offset sugared
-//                   | ld <HexLiteral / by 4, [0x0, 0x3c]> ( <Register> ) ,
+//                   | ld <Expression / by 4, [0x0, 0x3c]> ( <Register> ) ,
 //                   <Register> // ld offset
 //                                                                    no sugar
 //                   | ld ( <Register> , <Register> , 4 ) <Register> // ld index
 //                   | st <Register> , ( <Register> ) // st offset sugared
-//                   | st <Register> , <HexLiteral / by 4, [0, 60]> ( <Register>
+//                   | st <Register> , <Expression / by 4, [0, 60]> ( <Register>
 //                   ) // st offset
 //                                                                    no sugar
 //                   | st <Register> , ( <Register> , <Register> , 4 ) // st
@@ -72,16 +309,16 @@ vector<uint8_t> generateBinary(const vector<Token>&);
 //                   | nop
 //                   | <BinaryOperator> <Register> , <Register>
 //                   | <UnaryOperator> <Register>
-//                   | sh[lr] $ <HexLiteral [0, 0x7f]> , <Register>
-//                   | gpc $ <HexLiteral> / by 2, [0, 0x1e], <Register>
-//                   | j <HexLiteral, uint>
+//                   | sh[lr] $ <Expression [0, 0x7f]> , <Register>
+//                   | gpc $ <Expression> / by 2, [0, 0x1e], <Register>
+//                   | j <Expression, uint>
 //                   | j ( <Register> )
-//                   | j <HexLiteral, / by 2, [0, 0x1e]> ( <Register> )
-//                   | j * <HexLiteral, / by 4, [0, 0x3c]> ( <Register> )
+//                   | j <Expression, / by 2, [0, 0x1fe]> ( <Register> )
+//                   | j * <Expression, / by 4, [0, 0x3fc]> ( <Register> )
 //                   | j * ( <Register> , <Register> , 4 )
-//                   | br <HexLiteral, / by 2, 2's c [0x80, 0x7f]>
-//                   | beq <Register> , <HexLiteral, / by 2, 2's c [0x80, 0x7f]>
-//                   | bgt <Register> , <HexLiteral, / by 2, 2's c [0x80, 0x7f]>
+//                   | br <Expression, / by 2, 2's c [0x80, 0x7f]>
+//                   | beq <Register> , <Expression, / by 2, 2's c [0x80, 0x7f]>
+//                   | bgt <Register> , <Expression, / by 2, 2's c [0x80, 0x7f]>
 }  // namespace sm213assemble::model
 
 #endif  // SM213ASSEMBLE_MODEL_GENERATOR_H_
\ No newline at end of file
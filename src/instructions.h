@@ -0,0 +1,352 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+// Every instruction form the assembler knows, as one compile-time table. The
+// parser picks a form by mnemonic and operand shapes, and the encoder fills in
+// the form's encoding template - nothing else needs to know about opcodes.
+
+#ifndef SM213ASSEMBLE_MODEL_INSTRUCTIONS_H_
+#define SM213ASSEMBLE_MODEL_INSTRUCTIONS_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+namespace sm213assemble::model {
+namespace {
+using std::array;
+using std::index_sequence;
+using std::make_index_sequence;
+using std::size_t;
+using std::string_view;
+}  // namespace
+
+// syntactic shape of an operand
+enum class OperandKind {
+  REGISTER,          // rN
+  IMMEDIATE,         // $ <value>
+  MEMORY,            // <value> ( rb ) or ( rb )
+  INDEXED,           // ( rb , ri , 4 )
+  INDIRECT_MEMORY,   // * <value> ( rb ) or * ( rb )
+  INDIRECT_INDEXED,  // * ( rb , ri , 4 )
+  TARGET,            // <value>
+};
+
+// Binds an operand to fields of the encoding template. Register and value
+// operands use field; memory operands put their offset in field and their base
+// in field2; indexed operands put their base in field and index in field2.
+struct OperandSpec {
+  OperandKind kind;
+  char field;
+  char field2;
+};
+
+// Constraints on the value field. min and max apply to the value after it's
+// divided by scale. Labels are only allowed where allowLabel is set, and are
+// resolved relative to the next instruction if pcRelative is set.
+struct ValueSpec {
+  long scale;
+  long min;
+  long max;
+  bool negate;
+  bool pcRelative;
+  bool allowLabel;
+};
+
+// Encoding templates are written one character per nibble - fixed nibbles are
+// uppercase hex digits, and fields are lowercase letters:
+//   s, d, b, i - source, destination, base, and index registers
+//   o, p, v    - value field (nibble, byte, or word sized)
+struct InstructionForm {
+  string_view mnemonic;
+  string_view encoding;
+  size_t operandCount;
+  array<OperandSpec, 2> operands;
+  ValueSpec value;
+};
+
+// register and value fields of one instruction, ready for encoding
+struct Fields {
+  uint8_t s;
+  uint8_t d;
+  uint8_t b;
+  uint8_t i;
+  uint32_t value;
+};
+
+// bytes in the address space - one past the last address
+constexpr uint64_t MEMORY_SIZE = uint64_t{0xffffffff} + 1;
+
+// writes number to out as a word - four bytes, most significant first
+constexpr void putInt(uint32_t number, uint8_t* out) {
+  out[0] = static_cast<uint8_t>(number >> (3 * 8));
+  out[1] = static_cast<uint8_t>(number >> (2 * 8));
+  out[2] = static_cast<uint8_t>(number >> (1 * 8));
+  out[3] = static_cast<uint8_t>(number >> (0 * 8));
+}
+
+namespace {
+constexpr OperandSpec NONE{OperandKind::REGISTER, '\0', '\0'};
+
+constexpr OperandSpec reg(char field) {
+  return {OperandKind::REGISTER, field, '\0'};
+}
+constexpr OperandSpec imm(char field) {
+  return {OperandKind::IMMEDIATE, field, '\0'};
+}
+constexpr OperandSpec target(char field) {
+  return {OperandKind::TARGET, field, '\0'};
+}
+constexpr OperandSpec mem(char offset, char base) {
+  return {OperandKind::MEMORY, offset, base};
+}
+constexpr OperandSpec indirectMem(char offset, char base) {
+  return {OperandKind::INDIRECT_MEMORY, offset, base};
+}
+constexpr OperandSpec indexed(char base, char index) {
+  return {OperandKind::INDEXED, base, index};
+}
+constexpr OperandSpec indirectIndexed(char base, char index) {
+  return {OperandKind::INDIRECT_INDEXED, base, index};
+}
+
+constexpr ValueSpec NO_VALUE{1, 0, 0, false, false, false};
+constexpr ValueSpec WORD{1, 0, 0xffffffff, false, false, true};
+constexpr ValueSpec BRANCH{2, -0x80, 0x7f, false, true, true};
+constexpr ValueSpec MEMORY_OFFSET{4, 0, 0xf, false, false, false};
+constexpr ValueSpec PC_OFFSET{2, 0, 0xf, false, false, false};
+constexpr ValueSpec SHIFT_LEFT{1, 0, 0x7f, false, false, false};
+constexpr ValueSpec SHIFT_RIGHT{1, 0, 0x80, true, false, false};
+constexpr ValueSpec JUMP_OFFSET{2, 0, 0xff, false, false, false};
+constexpr ValueSpec INDIRECT_OFFSET{4, 0, 0xff, false, false, false};
+}  // namespace
+
+constexpr array<InstructionForm, 25> INSTRUCTION_FORMS{{
+    {"ld", "0d00vvvvvvvv", 2, {{imm('v'), reg('d')}}, WORD},
+    {"ld", "1obd", 2, {{mem('o', 'b'), reg('d')}}, MEMORY_OFFSET},
+    {"ld", "2bid", 2, {{indexed('b', 'i'), reg('d')}}, NO_VALUE},
+    {"st", "3sob", 2, {{reg('s'), mem('o', 'b')}}, MEMORY_OFFSET},
+    {"st", "4sbi", 2, {{reg('s'), indexed('b', 'i')}}, NO_VALUE},
+    {"mov", "60sd", 2, {{reg('s'), reg('d')}}, NO_VALUE},
+    {"add", "61sd", 2, {{reg('s'), reg('d')}}, NO_VALUE},
+    {"and", "62sd", 2, {{reg('s'), reg('d')}}, NO_VALUE},
+    {"inc", "630d", 1, {{reg('d'), NONE}}, NO_VALUE},
+    {"inca", "640d", 1, {{reg('d'), NONE}}, NO_VALUE},
+    {"dec", "650d", 1, {{reg('d'), NONE}}, NO_VALUE},
+    {"deca", "660d", 1, {{reg('d'), NONE}}, NO_VALUE},
+    {"not", "670d", 1, {{reg('d'), NONE}}, NO_VALUE},
+    {"gpc", "6Fod", 2, {{imm('o'), reg('d')}}, PC_OFFSET},
+    {"shl", "7dpp", 2, {{imm('p'), reg('d')}}, SHIFT_LEFT},
+    {"shr", "7dpp", 2, {{imm('p'), reg('d')}}, SHIFT_RIGHT},
+    {"br", "80pp", 1, {{target('p'), NONE}}, BRANCH},
+    {"beq", "9spp", 2, {{reg('s'), target('p')}}, BRANCH},
+    {"bgt", "Aspp", 2, {{reg('s'), target('p')}}, BRANCH},
+    {"j", "B000vvvvvvvv", 1, {{target('v'), NONE}}, WORD},
+    {"j", "Cbpp", 1, {{mem('p', 'b'), NONE}}, JUMP_OFFSET},
+    {"j", "Dbpp", 1, {{indirectMem('p', 'b'), NONE}}, INDIRECT_OFFSET},
+    {"j", "Ebi0", 1, {{indirectIndexed('b', 'i'), NONE}}, NO_VALUE},
+    {"halt", "F000", 0, {{NONE, NONE}}, NO_VALUE},
+    {"nop", "FF00", 0, {{NONE, NONE}}, NO_VALUE},
+}};
+
+constexpr bool isField(char c) {
+  return c == 's' || c == 'd' || c == 'b' || c == 'i' || c == 'o' ||
+         c == 'p' || c == 'v';
+}
+constexpr bool isValueField(char c) { return c == 'o' || c == 'p' || c == 'v'; }
+
+// size in bytes of an encoded instruction
+constexpr size_t instructionSize(const InstructionForm& form) {
+  return form.encoding.size() / 2;
+}
+
+// number of nibbles in the value field - 0 if the form has no value
+constexpr unsigned valueWidth(const InstructionForm& form) {
+  unsigned width = 0;
+  for (char c : form.encoding)
+    if (isValueField(c)) width++;
+  return width;
+}
+
+// byte offset of the value field within the encoded instruction
+constexpr size_t valueOffset(const InstructionForm& form) {
+  for (size_t idx = 0; idx < form.encoding.size(); idx++)
+    if (isValueField(form.encoding[idx])) return idx / 2;
+  return instructionSize(form);
+}
+
+// number of value nibbles before the given one
+constexpr unsigned valueNibblesBefore(const InstructionForm& form,
+                                      size_t nibble) {
+  unsigned count = 0;
+  for (size_t idx = 0; idx < nibble; idx++)
+    if (isValueField(form.encoding[idx])) count++;
+  return count;
+}
+
+constexpr uint8_t fieldNibble(const Fields& fields, char field, unsigned idx,
+                              unsigned width) {
+  switch (field) {
+    case 's':
+      return fields.s;
+    case 'd':
+      return fields.d;
+    case 'b':
+      return fields.b;
+    case 'i':
+      return fields.i;
+    default:
+      return static_cast<uint8_t>((fields.value >> (4 * (width - 1 - idx))) &
+                                  0xf);
+  }
+}
+
+// Each form gets its own encoder, with the source of every nibble of its
+// template worked out at compile time, so encoding is a few shifts and masks.
+template <size_t FORM, size_t NIBBLE>
+constexpr uint8_t encodedNibble(const Fields& fields) {
+  constexpr const InstructionForm& form = INSTRUCTION_FORMS[FORM];
+  constexpr char c = form.encoding[NIBBLE];
+  if constexpr (c >= '0' && c <= '9') {
+    return static_cast<uint8_t>(c - '0');
+  } else if constexpr (c >= 'A' && c <= 'F') {
+    return static_cast<uint8_t>(c - 'A' + 0xa);
+  } else {
+    constexpr unsigned valueIdx = valueNibblesBefore(form, NIBBLE);
+    return fieldNibble(fields, c, valueIdx, valueWidth(form));
+  }
+}
+template <size_t FORM, size_t... NIBBLES>
+constexpr void encodeNibbles(const Fields& fields, uint8_t* out,
+                             index_sequence<NIBBLES...>) {
+  ((out[NIBBLES / 2] = static_cast<uint8_t>(
+        NIBBLES % 2 == 0
+            ? encodedNibble<FORM, NIBBLES>(fields) << 4
+            : out[NIBBLES / 2] | encodedNibble<FORM, NIBBLES>(fields))),
+   ...);
+}
+template <size_t FORM>
+constexpr void encodeForm(const Fields& fields, uint8_t* out) {
+  encodeNibbles<FORM>(
+      fields, out,
+      make_index_sequence<INSTRUCTION_FORMS[FORM].encoding.size()>());
+}
+
+typedef void (*Encoder)(const Fields&, uint8_t*);
+template <size_t... FORMS>
+constexpr array<Encoder, sizeof...(FORMS)> encoders(index_sequence<FORMS...>) {
+  return {{&encodeForm<FORMS>...}};
+}
+// encoders, indexed like INSTRUCTION_FORMS
+constexpr array<Encoder, INSTRUCTION_FORMS.size()> ENCODERS =
+    encoders(make_index_sequence<INSTRUCTION_FORMS.size()>());
+
+// writes instructionSize(form) bytes to out - form must be in
+// INSTRUCTION_FORMS
+constexpr void encode(const InstructionForm& form, const Fields& fields,
+                      uint8_t* out) {
+  ENCODERS[static_cast<size_t>(&form - INSTRUCTION_FORMS.data())](fields, out);
+}
+// the fields encode wrote to bytes, for a form read back from an image
+constexpr Fields decode(const InstructionForm& form, const uint8_t* bytes) {
+  Fields fields{0, 0, 0, 0, 0};
+  for (size_t idx = 0; idx < form.encoding.size(); idx++) {
+    uint8_t nibble = static_cast<uint8_t>(
+        idx % 2 == 0 ? bytes[idx / 2] >> 4 : bytes[idx / 2] & 0xf);
+    switch (form.encoding[idx]) {
+      case 's':
+        fields.s = nibble;
+        break;
+      case 'd':
+        fields.d = nibble;
+        break;
+      case 'b':
+        fields.b = nibble;
+        break;
+      case 'i':
+        fields.i = nibble;
+        break;
+      default:
+        if (isValueField(form.encoding[idx]))
+          fields.value = fields.value << 4 | nibble;
+    }
+  }
+  return fields;
+}
+
+constexpr bool usesField(const InstructionForm& form, char field) {
+  for (char c : form.encoding)
+    if (c == field) return true;
+  return false;
+}
+constexpr unsigned bindings(const InstructionForm& form, char field) {
+  unsigned count = 0;
+  for (size_t idx = 0; idx < form.operandCount; idx++) {
+    if (form.operands[idx].field == field) count++;
+    if (form.operands[idx].field2 == field) count++;
+  }
+  return count;
+}
+// Checks, at compile time, that every template is made of whole bytes, uses
+// only known characters, has contiguous value nibbles, and binds each field it
+// uses to exactly one operand.
+constexpr bool validForm(const InstructionForm& form) {
+  if (form.encoding.size() != 4 && form.encoding.size() != 12) return false;
+  if (form.operandCount > form.operands.size()) return false;
+
+  size_t firstValue = form.encoding.size(), lastValue = 0;
+  for (size_t idx = 0; idx < form.encoding.size(); idx++) {
+    char c = form.encoding[idx];
+    if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || isField(c)))
+      return false;
+    if (isField(c) && bindings(form, c) != 1) return false;
+    if (isValueField(c)) {
+      if (firstValue == form.encoding.size()) firstValue = idx;
+      lastValue = idx;
+    }
+  }
+  if (firstValue != form.encoding.size() &&
+      lastValue - firstValue + 1 != valueWidth(form))
+    return false;
+
+  for (size_t idx = 0; idx < form.operandCount; idx++) {
+    const OperandSpec& op = form.operands[idx];
+    if (!usesField(form, op.field)) return false;
+    if (op.field2 != '\0' && !usesField(form, op.field2)) return false;
+  }
+
+  long limit = valueWidth(form) == 8 ? 0xffffffff
+                                     : (1L << (4 * valueWidth(form))) - 1;
+  if (form.value.scale < 1 || form.value.min > form.value.max) return false;
+  if (form.value.max > limit || form.value.min < -(limit + 1) / 2)
+    return false;
+  if (form.value.allowLabel && form.value.pcRelative &&
+      valueOffset(form) + 1 != instructionSize(form))
+    return false;
+  return true;
+}
+constexpr bool validForms() {
+  for (const InstructionForm& form : INSTRUCTION_FORMS)
+    if (!validForm(form)) return false;
+  return true;
+}
+static_assert(validForms(), "malformed entry in INSTRUCTION_FORMS");
+}  // namespace sm213assemble::model
+
+#endif  // SM213ASSEMBLE_MODEL_INSTRUCTIONS_H_
\ No newline at end of file
@@ -17,6 +17,11 @@
 
 #include "io.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 
 namespace sm213assemble::io {
@@ -24,7 +29,7 @@ namespace {
 using std::find;
 using std::to_string;
 
-const char* SPECIAL_SYMBOLS = "()$,*";
+const char* SPECIAL_SYMBOLS = "()$,*+-/";
 const char* PSEUDO_ALPHA = "_.:";
 }  // namespace
 
@@ -33,39 +38,49 @@ Token::Token(string v, unsigned l, unsigned c) noexcept
 
 const char* FileOpenError::what() const noexcept { return ""; }
 
-IllegalCharacter::IllegalCharacter(char character, unsigned line,
+IllegalCharacter::IllegalCharacter(char c, unsigned line,
                                    unsigned column) noexcept
-    : msg{to_string(line) + ":" + to_string(column) +
-          ":illegal character: " + string(1, character)} {}
+    : character{c},
+      lineNo{line},
+      charNo{column},
+      msg{to_string(line) + ":" + to_string(column) + ":" + message()} {}
 const char* IllegalCharacter::what() const noexcept { return msg.c_str(); }
+unsigned IllegalCharacter::line() const noexcept { return lineNo; }
+unsigned IllegalCharacter::column() const noexcept { return charNo; }
+string IllegalCharacter::message() const {
+  return "illegal character: " + string(1, character);
+}
 
-vector<Token> tokenize(ifstream& fin) {
-  vector<Token> rsf;
-  Token tokenBuffer("", 1, 1);
-  char readBuffer;
+bool tokenizeLine(istream& fin, unsigned currLine, vector<Token>& rsf) {
+  string line;
+  if (!getline(fin, line)) return false;
 
-  unsigned currLine = 1, currChar = 1;
+  Token tokenBuffer("", currLine, 1);
+  unsigned currChar = 1;
   bool inComment = false;
+  bool inString = false;
 
-  while (fin.get(readBuffer)) {
-    if (readBuffer ==
-        '\n') {  // reached end of line - don't care if comment or no.
-      Token temp = Token("\n", currLine, currChar);
-      currLine++;  // reset line count, commented flag
-      currChar = 1;
-      inComment = false;
-      if (!tokenBuffer.value.empty())
-        rsf.push_back(tokenBuffer);  // record token if not empty
-      rsf.push_back(temp);
-      tokenBuffer = Token("", currLine, currChar);  // reset token
-    } else if (inComment) {  // in a comment - don't do anything with these
-                             // chars.
+  for (char readBuffer : line) {
+    if (inComment) {  // in a comment - don't do anything with these chars.
+      currChar++;
+    } else if (inString) {  // string literal - keep everything, quotes too
+      tokenBuffer.value += readBuffer;
+      currChar++;
+      if (readBuffer == '"') {
+        rsf.push_back(tokenBuffer);
+        inString = false;
+        tokenBuffer = Token("", currLine, currChar);
+      }
+    } else if (readBuffer == '"') {  // start of string literal
+      if (!tokenBuffer.value.empty()) rsf.push_back(tokenBuffer);
+      tokenBuffer = Token("\"", currLine, currChar);
+      inString = true;
       currChar++;
     } else if (readBuffer == '#') {  // start of comment
       inComment = true;              // turn start of comment to true
       currChar++;
-    } else if (find(SPECIAL_SYMBOLS, SPECIAL_SYMBOLS + 5, readBuffer) !=
-               SPECIAL_SYMBOLS + 5) {  // is a special symbol
+    } else if (find(SPECIAL_SYMBOLS, SPECIAL_SYMBOLS + 8, readBuffer) !=
+               SPECIAL_SYMBOLS + 8) {  // is a special symbol
       if (!tokenBuffer.value.empty())
         rsf.push_back(tokenBuffer);  // save token if not empty
       rsf.push_back(Token(string(1, readBuffer), currLine,
@@ -92,20 +107,46 @@ vector<Token> tokenize(ifstream& fin) {
     }
   }
 
-  return rsf;
+  if (inString)  // unterminated string
+    throw IllegalCharacter('"', currLine, tokenBuffer.charNo);
+  if (!tokenBuffer.value.empty())
+    rsf.push_back(tokenBuffer);  // record token if not empty
+  if (!fin.eof())                // reached end of line, not end of file
+    rsf.push_back(Token("\n", currLine, currChar));
+  return true;
 }
 
-void writeBinary(const vector<uint8_t>& binary, const string& fn) {
-  ofstream fout;
-  fout.open(fn,
-            std::ios_base::binary | std::ios_base::trunc | std::ios_base::out);
-
-  if (!fout.is_open()) throw FileOpenError();
+vector<Token> tokenize(istream& fin) {
+  vector<Token> rsf;
+  unsigned currLine = 1;
+  while (tokenizeLine(fin, currLine, rsf)) currLine++;
+  return rsf;
+}
 
-  for (uint8_t byte : binary) fout << byte;
+MappedFile::MappedFile(const string& path) : bytes{nullptr}, length{0} {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) throw FileOpenError();
 
-  fout.flush();
-  fout.close();
-  return;
+  struct stat info;
+  if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    throw FileOpenError();
+  }
+  length = static_cast<size_t>(info.st_size);
+  if (length != 0) {  // can't map nothing
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      close(fd);
+      throw FileOpenError();
+    }
+    bytes = static_cast<const uint8_t*>(mapped);
+  }
+  close(fd);  // the mapping outlives the descriptor
+}
+MappedFile::~MappedFile() noexcept {
+  if (bytes != nullptr)
+    munmap(const_cast<uint8_t*>(bytes), length);
 }
+const uint8_t* MappedFile::data() const noexcept { return bytes; }
+size_t MappedFile::size() const noexcept { return length; }
 }  // namespace sm213assemble::io
\ No newline at end of file
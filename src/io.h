@@ -18,7 +18,9 @@
 #ifndef SM213ASSEMBLE_IO_H_
 #define SM213ASSEMBLE_IO_H_
 
+#include <cstdint>
 #include <fstream>
+#include <istream>
 #include <stdexcept>
 #include <vector>
 
@@ -26,7 +28,7 @@ namespace sm213assemble::io {
 namespace {
 using std::exception;
 using std::ifstream;
-using std::ofstream;
+using std::istream;
 using std::string;
 using std::vector;
 }  // namespace
@@ -57,12 +59,40 @@ class IllegalCharacter : public exception {
 
   const char* what() const noexcept override;
 
+  // the parts of what() on their own
+  unsigned line() const noexcept;
+  unsigned column() const noexcept;
+  string message() const;
+
  private:
+  char character;
+  unsigned lineNo;
+  unsigned charNo;
   string msg;
 };
 
-void writeBinary(const vector<uint8_t>&, const string&);
-vector<Token> tokenize(ifstream&);
+// A read-only view of a whole file, mapped into memory rather than read.
+class MappedFile {
+ public:
+  explicit MappedFile(const string& path);
+  MappedFile(const MappedFile&) = delete;
+  ~MappedFile() noexcept;
+
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const noexcept;
+  size_t size() const noexcept;
+
+ private:
+  const uint8_t* bytes;  // null if the file is empty
+  size_t length;
+};
+
+vector<Token> tokenize(istream&);
+// Appends the tokens on the next line to the vector, including its newline if
+// it has one. String literals are single tokens, quotes included. Returns false
+// once there are no more lines.
+bool tokenizeLine(istream&, unsigned lineNo, vector<Token>&);
 }  // namespace sm213assemble::io
 
 #endif  // SM213ASSEMBLE_IO_H_
\ No newline at end of file
@@ -17,74 +17,367 @@
 
 // SM213 assembler takes one command line argument - target .sm213 file, then
 // assembles target file into a .img file. Resulting file name is source file
-// name with changed extension.
+// name with changed extension, unless given explicitly with -o. A file name of
+// '-' means stdin for the source, or stdout for the image; images assembled
+// from stdin go to stdout unless -o is given.
+//
+// Given more than one source file, each is assembled into its own .img in
+// turn, with every program parsed into the same arena, which is reset between
+// them (see arena.h). Batches can't use -o, --stream, --analyze, or --verify.
+//
+// With --stream, the image is written to its file while the source is still
+// being read, so memory use doesn't grow with the size of the program. Label
+// uses still waiting for their label past --fixup-budget (default 1048576) are
+// kept in a temporary file instead of memory.
+//
+// With --analyze, no image is written; instead, a report of basic blocks,
+// instruction counts, memory accesses, static cycle estimates, and unreachable
+// code goes to stdout. --cycles names a cycle model file for the estimates
+// (see analysis.h).
+//
+// With -O, wasteful instruction sequences are rewritten before the image is
+// placed (see optimizer.h), and what that saved goes to stderr. It needs the
+// whole program, so it can't be used with --stream, and --analyze looks at the
+// program as written, so it can't be used with that either. --fold likewise
+// folds identical routines into one copy (see optimizer.h), after any -O, and
+// has the same limits. --fold-data folds identical data as well, which is
+// only safe if none of it is ever written to.
+//
+// With --verify, no image is written; instead, the program is compared against
+// the given image as it's encoded, and the first address that differs is
+// reported, along with the line that placed it. Exits with failure if they
+// differ. It can't be used with --stream or --analyze.
+//
+// With --stats, how much memory each parsed program took from its arena (see
+// arena.h), how many blocks the arena had to take from the heap for it, and
+// how many heap allocations assembling it took in all, goes to stderr.
+//
+// usage: sm213assemble [-o <output>] [-O] [--fold] [--fold-data] [--stats]
+//                      [--stream [--fixup-budget <n>]]
+//                      [--analyze [--cycles <model>]] [--verify <image>]
+//                      <source>...
 
+#include "analysis.h"
+#include "arena.h"
 #include "generator.h"
 #include "io.h"
+#include "optimizer.h"
+#include "util.h"
 
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <vector>
 
 namespace {
+using sm213assemble::analysis::analyze;
+using sm213assemble::analysis::CycleModel;
+using sm213assemble::analysis::readCycleModel;
 using sm213assemble::io::FileOpenError;
 using sm213assemble::io::IllegalCharacter;
+using sm213assemble::io::MappedFile;
 using sm213assemble::io::Token;
 using sm213assemble::io::tokenize;
-using sm213assemble::io::writeBinary;
-using sm213assemble::model::generateBinary;
+using sm213assemble::model::checkProgram;
+using sm213assemble::model::Mismatch;
+using sm213assemble::model::parseProgram;
 using sm213assemble::model::ParseError;
+using sm213assemble::model::Program;
+using sm213assemble::model::streamBinary;
+using sm213assemble::model::verifyProgram;
+using sm213assemble::model::writeProgram;
+using sm213assemble::optimizer::fold;
+using sm213assemble::optimizer::peephole;
+using sm213assemble::optimizer::Savings;
+using sm213assemble::util::Arena;
+using sm213assemble::util::heapAllocations;
+using sm213assemble::util::hexify;
 using std::cerr;
+using std::cin;
+using std::cout;
 using std::ifstream;
+using std::isdigit;
+using std::istream;
 using std::ofstream;
+using std::optional;
 using std::string;
+using std::strtoul;
 using std::vector;
+
+// the source file name with its extension changed to .img
+string imageFileNameOf(const string& sourceFileName) {
+  string imageFileName = sourceFileName;
+  if (imageFileName.find_last_of('.') == string::npos)
+    imageFileName += ".img";
+  else
+    imageFileName.replace(imageFileName.find_last_of('.'),
+                          imageFileName.size(), ".img");
+  return imageFileName;
+}
+
+// Parses tokens into arena, runs the passes asked for, and writes the image
+// to the named file, or stdout for '-'. Throws ParseError or FileOpenError.
+void writeImage(const vector<Token>& tokens, const string& destinationFileName,
+                bool optimizing, bool folding, bool foldingData, Arena& arena) {
+  Program program = parseProgram(tokens, &arena);
+  Savings savings{0, 0}, folded{0, 0};
+  if (optimizing) savings = peephole(program);
+  if (folding) folded = fold(program, foldingData);
+  if (destinationFileName == "-")
+    writeProgram(program, cout);
+  else
+    writeProgram(program, destinationFileName);
+  if (optimizing)
+    cerr << "Optimized away " << savings.instructions << " instructions ("
+         << savings.bytes << " bytes).\n";
+  if (folding)
+    cerr << "Folded away " << folded.instructions << " instructions ("
+         << folded.bytes << " bytes).\n";
+}
+
+// what the last program took from arena, which had blocksBefore blocks
+// before it, and from the heap, which had given out heapBefore allocations
+void reportStats(const Arena& arena, size_t blocksBefore, size_t heapBefore) {
+  cerr << "Program took " << arena.bytes() << " bytes in "
+       << arena.allocations() << " allocations, from " << arena.blocks()
+       << " blocks (" << arena.blocks() - blocksBefore << " new), and "
+       << heapAllocations() - heapBefore << " heap allocations in all.\n";
+}
 }  // namespace
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    cerr << "Expected source file as only argument.\n";
+  vector<string> sourceFileNames;
+  string destinationFileName;
+  bool streaming = false;
+  bool analyzing = false;
+  bool optimizing = false;
+  bool folding = false;
+  bool foldingData = false;
+  bool reporting = false;
+  string cycleModelFileName;
+  string expectedFileName;
+  size_t fixupBudget = 1 << 20;
+  bool budgeting = false;  // if --fixup-budget was given
+  for (int idx = 1; idx < argc; idx++) {
+    string arg(argv[idx]);
+    if (arg == "-o") {
+      if (idx + 1 == argc) {
+        cerr << "Expected output file after '-o'.\n";
+        return EXIT_FAILURE;
+      }
+      destinationFileName = argv[++idx];
+    } else if (arg == "-O") {
+      optimizing = true;
+    } else if (arg == "--fold") {
+      folding = true;
+    } else if (arg == "--fold-data") {
+      folding = foldingData = true;
+    } else if (arg == "--stats") {
+      reporting = true;
+    } else if (arg == "--stream") {
+      streaming = true;
+    } else if (arg == "--analyze") {
+      analyzing = true;
+    } else if (arg == "--cycles") {
+      if (idx + 1 == argc || argv[idx + 1][0] == '\0') {
+        cerr << "Expected cycle model file after '--cycles'.\n";
+        return EXIT_FAILURE;
+      }
+      cycleModelFileName = argv[++idx];
+    } else if (arg == "--verify") {
+      if (idx + 1 == argc) {
+        cerr << "Expected image file after '--verify'.\n";
+        return EXIT_FAILURE;
+      }
+      expectedFileName = argv[++idx];
+    } else if (arg == "--fixup-budget") {
+      // strtoul would take a sign or spaces, and nothing at all as 0
+      const char* text = idx + 1 < argc ? argv[++idx] : "";
+      char* end = nullptr;
+      errno = 0;
+      if (isdigit(static_cast<unsigned char>(text[0])))
+        fixupBudget = strtoul(text, &end, 0);
+      if (end == nullptr || *end != '\0' || errno == ERANGE) {
+        cerr << "Expected number after '--fixup-budget'.\n";
+        return EXIT_FAILURE;
+      }
+      budgeting = true;
+    } else {
+      sourceFileNames.push_back(arg);
+    }
+  }
+  if (sourceFileNames.empty()) {
+    cerr << "Expected source file as argument.\n";
     return EXIT_FAILURE;
   }
 
-  string sourceFileName(argv[1]);
-  string destinationFileName = sourceFileName;
-  if (destinationFileName.find_last_of('.') == string::npos)
-    destinationFileName += ".img";
-  else
-    destinationFileName.replace(destinationFileName.find_last_of('.'),
-                                destinationFileName.size(), ".img");
+  if (optimizing && (streaming || analyzing)) {
+    cerr << "-O can't be used with --stream or --analyze.\n";
+    return EXIT_FAILURE;
+  }
+  if (folding && (streaming || analyzing)) {
+    cerr << (foldingData ? "--fold-data" : "--fold")
+         << " can't be used with --stream or --analyze.\n";
+    return EXIT_FAILURE;
+  }
+  if (!expectedFileName.empty() && (streaming || analyzing)) {
+    cerr << "--verify can't be used with --stream or --analyze.\n";
+    return EXIT_FAILURE;
+  }
+  if (!cycleModelFileName.empty() && !analyzing) {
+    cerr << "--cycles needs --analyze.\n";
+    return EXIT_FAILURE;
+  }
+  if (budgeting && !streaming) {
+    cerr << "--fixup-budget needs --stream.\n";
+    return EXIT_FAILURE;
+  }
+
+  Arena arena;  // for the program, however it's assembled
+  if (sourceFileNames.size() > 1) {  // batch - one arena, reset for each file
+    if (!destinationFileName.empty() || streaming || analyzing ||
+        !expectedFileName.empty()) {
+      cerr << "-o, --stream, --analyze, and --verify need a single source "
+              "file.\n";
+      return EXIT_FAILURE;
+    }
+    bool succeeded = true;
+    for (const string& sourceFileName : sourceFileNames) {
+      ifstream fin(sourceFileName);
+      if (sourceFileName == "-" || !fin.is_open()) {
+        cerr << sourceFileName << '\n';
+        cerr << "Could not open source file.\n";
+        succeeded = false;
+        continue;
+      }
+      size_t blocksBefore = arena.blocks();
+      size_t heapBefore = heapAllocations();
+      try {
+        writeImage(tokenize(fin), imageFileNameOf(sourceFileName), optimizing,
+                   folding, foldingData, arena);
+        if (reporting) reportStats(arena, blocksBefore, heapBefore);
+      } catch (const IllegalCharacter& e) {
+        cerr << sourceFileName << ':' << e.what() << '\n';
+        succeeded = false;
+      } catch (const ParseError& e) {
+        cerr << sourceFileName << ':' << e.what() << '\n';
+        succeeded = false;
+      } catch (const FileOpenError&) {
+        cerr << imageFileNameOf(sourceFileName) << '\n';
+        cerr << "Could not open output file.\n";
+        succeeded = false;
+      }
+      arena.reset();
+    }
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  size_t heapBefore = heapAllocations();
+  const string& sourceFileName = sourceFileNames.front();
+  if (destinationFileName.empty() && sourceFileName == "-")
+    destinationFileName = "-";
+  else if (destinationFileName.empty())
+    destinationFileName = imageFileNameOf(sourceFileName);
 
   ifstream fin;
-  fin.open(sourceFileName);
+  if (sourceFileName != "-") {
+    fin.open(sourceFileName);
 
-  if (!fin.is_open()) {
-    cerr << sourceFileName << '\n';
-    cerr << "Could not open source file. Aborting.\n";
-    return EXIT_FAILURE;
+    if (!fin.is_open()) {
+      cerr << sourceFileName << '\n';
+      cerr << "Could not open source file. Aborting.\n";
+      return EXIT_FAILURE;
+    }
+  }
+  istream& source = sourceFileName == "-" ? cin : fin;
+
+  if (streaming) {
+    if (destinationFileName == "-") {
+      cerr << "Streaming needs an output file, not stdout.\n";
+      return EXIT_FAILURE;
+    }
+    try {
+      streamBinary(source, destinationFileName, fixupBudget);
+    } catch (const IllegalCharacter& e) {
+      cerr << e.what() << '\n';
+      return EXIT_FAILURE;
+    } catch (const ParseError& e) {
+      cerr << e.what() << '\n';
+      return EXIT_FAILURE;
+    } catch (const FileOpenError&) {
+      cerr << "Could not open output file. Aborting.\n";
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
   }
 
   vector<Token> tokens;
   try {
-    tokens = tokenize(fin);
+    tokens = tokenize(source);
   } catch (const IllegalCharacter& e) {
     cerr << e.what() << '\n';
     return EXIT_FAILURE;
   }
-  vector<uint8_t> binary;
-  try {
-    binary = generateBinary(tokens);
-  } catch (const ParseError& e) {
-    cerr << e.what() << '\n';
+  if (analyzing) {
+    CycleModel model;
+    try {
+      if (!cycleModelFileName.empty()) {
+        ifstream modelFile(cycleModelFileName);
+        if (!modelFile.is_open()) {
+          cerr << cycleModelFileName << '\n';
+          cerr << "Could not open cycle model file. Aborting.\n";
+          return EXIT_FAILURE;
+        }
+        model = readCycleModel(modelFile);
+      }
+      Program program = parseProgram(tokens, &arena);
+      checkProgram(program);
+      analyze(program, model, cout);
+    } catch (const IllegalCharacter& e) {
+      cerr << e.what() << '\n';
+      return EXIT_FAILURE;
+    } catch (const ParseError& e) {
+      cerr << e.what() << '\n';
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (!expectedFileName.empty()) {
+    try {
+      MappedFile expected(expectedFileName);
+      Program program = parseProgram(tokens, &arena);
+      if (optimizing) peephole(program);
+      if (folding) fold(program, foldingData);
+      optional<Mismatch> mismatch =
+          verifyProgram(program, expected.data(), expected.size());
+      if (!mismatch) return EXIT_SUCCESS;
+      cerr << "Mismatch at " << hexify(static_cast<long>(mismatch->address));
+      if (mismatch->lineNo != 0) cerr << " (line " << mismatch->lineNo << ")";
+      cerr << ".\n";
+    } catch (const ParseError& e) {
+      cerr << e.what() << '\n';
+    } catch (const FileOpenError&) {
+      cerr << expectedFileName << '\n';
+      cerr << "Could not open image file. Aborting.\n";
+    }
     return EXIT_FAILURE;
   }
 
   try {
-    writeBinary(binary, destinationFileName);
+    writeImage(tokens, destinationFileName, optimizing, folding, foldingData,
+               arena);
+  } catch (const ParseError& e) {
+    cerr << e.what() << '\n';
+    return EXIT_FAILURE;
   } catch (const FileOpenError&) {
     cerr << "Could not open output file. Aborting.\n";
     return EXIT_FAILURE;
   }
+  if (reporting) reportStats(arena, 0, heapBefore);
 
   return EXIT_SUCCESS;
 }
\ No newline at end of file
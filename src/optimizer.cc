@@ -0,0 +1,518 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "optimizer.h"
+#include "instructions.h"
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sm213assemble::optimizer {
+namespace {
+using sm213assemble::model::Fields;
+using sm213assemble::model::fieldsOf;
+using sm213assemble::model::formOf;
+using sm213assemble::model::INSTRUCTION_FORMS;
+using sm213assemble::model::InstructionForm;
+using sm213assemble::model::instructionSize;
+using sm213assemble::model::isInstruction;
+using sm213assemble::model::layout;
+using sm213assemble::model::OperandKind;
+using sm213assemble::model::packRegisters;
+using sm213assemble::model::statementSize;
+using std::equal;
+using std::find_if;
+using std::max;
+using std::min;
+using std::move;
+using std::optional;
+using std::pair;
+using std::sort;
+using std::string_view;
+using std::unordered_map;
+using std::upper_bound;
+using std::vector;
+
+// stretches of code, by where they're laid out, that literal PC-relative
+// offsets, offsets from labels, or differences of labels count across - sorted
+// and merged
+typedef vector<pair<long, long>> Spans;
+
+// the op of the instruction form with the given mnemonic
+uint8_t opNamed(string_view mnemonic) {
+  return static_cast<uint8_t>(
+      find_if(INSTRUCTION_FORMS.begin(), INSTRUCTION_FORMS.end(),
+              [mnemonic](const InstructionForm& form) {
+                return form.mnemonic == mnemonic;
+              }) -
+      INSTRUCTION_FORMS.begin());
+}
+
+bool isSymbolic(const Program& program, size_t idx) noexcept {
+  return (program.ops[idx] & Program::SYMBOLIC) != 0;
+}
+bool isMnemonic(const Program& program, size_t idx,
+                string_view mnemonic) noexcept {
+  return idx < program.ops.size() && isInstruction(program, idx) &&
+         formOf(program, idx).mnemonic == mnemonic;
+}
+
+Spans spansOf(const Program& program, const vector<uint64_t>& starts) {
+  vector<long> symbolPos(program.symbols.size(), 0);
+  unordered_map<string_view, size_t> symbols;
+  for (size_t idx = 0; idx < program.ops.size(); idx++)
+    if (program.ops[idx] == Program::LABEL)
+      symbolPos[program.values[idx]] = static_cast<long>(starts[idx]);
+  for (size_t symbol = 0; symbol < program.symbols.size(); symbol++)
+    symbols.emplace(program.symbols[symbol], symbol);
+
+  Spans spans;
+  auto addOffset = [&](size_t symbol, uint32_t addend) {
+    long start = symbolPos[symbol];
+    long end = start + static_cast<int32_t>(addend);
+    if (addend != 0) spans.emplace_back(min(start, end), max(start, end));
+  };
+  for (const Program::Difference& difference : program.differences) {
+    long to = symbolPos[difference.to], from = symbolPos[difference.from];
+    if (to != from) spans.emplace_back(min(to, from), max(to, from));
+  }
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    if (isSymbolic(program, idx)) {
+      const Program::SymbolUse& use = program.symbolUses[program.values[idx]];
+      addOffset(use.symbol, use.addend);
+      continue;
+    }
+    if (program.ops[idx] == Program::BYTES)
+      for (const auto& use : program.chunks[program.values[idx]].uses)
+        if (symbols.count(use.labelName) != 0)
+          addOffset(symbols[use.labelName], use.addend);
+    if (!isInstruction(program, idx)) continue;
+
+    const InstructionForm& form = formOf(program, idx);
+    uint32_t value = program.values[idx];
+    long end = static_cast<long>(starts[idx] + instructionSize(form));
+    long target;
+    if (form.mnemonic == "gpc")
+      target = end + 2 * static_cast<long>(value);
+    else if (form.value.pcRelative)
+      target = end + 2 * static_cast<int8_t>(value & 0xff);
+    else
+      continue;
+    spans.emplace_back(min(end, target), max(end, target));
+  }
+
+  sort(spans.begin(), spans.end());
+  Spans merged;
+  for (const auto& span : spans) {
+    if (!merged.empty() && span.first <= merged.back().second)
+      merged.back().second = max(merged.back().second, span.second);
+    else
+      merged.push_back(span);
+  }
+  return merged;
+}
+bool inSpan(const Spans& spans, uint64_t pos) noexcept {
+  auto after = upper_bound(
+      spans.begin(), spans.end(), static_cast<long>(pos),
+      [](long p, const pair<long, long>& span) { return p < span.first; });
+  return after != spans.begin() &&
+         static_cast<long>(pos) < (after - 1)->second;
+}
+
+// copies statement from over statement to, along with where it starts
+void moveStatement(Program& program, vector<uint64_t>& starts, size_t from,
+                   size_t to) noexcept {
+  program.ops[to] = program.ops[from];
+  program.registers[to] = program.registers[from];
+  program.values[to] = program.values[from];
+  program.lines[to] = program.lines[from];
+  starts[to] = starts[from];
+}
+// copies statement idx onto the end of result
+void keep(const Program& program, size_t idx, Program& result) {
+  result.push(program.ops[idx], program.registers[idx], program.values[idx],
+              program.lines[idx]);
+}
+// an instruction standing in for a sequence starting at statement idx
+void replace(const Program& program, size_t idx, uint8_t op,
+             const Fields& fields, Program& result) {
+  result.push(op, packRegisters(fields), fields.value, program.lines[idx]);
+}
+
+// statements in the longest sequence rewrite looks at
+constexpr size_t LONGEST_SEQUENCE = 4;
+
+// Rewrites the sequence starting at statement idx into result, if it can be,
+// never making more statements than it uses up. Returns how many statements
+// were used up - zero if none were.
+size_t rewrite(const Program& program, size_t idx,
+               const vector<uint64_t>& starts, const Spans& spans,
+               Program& result, Savings& savings) {
+  if (!isInstruction(program, idx) || inSpan(spans, starts[idx])) return 0;
+  const InstructionForm& form = formOf(program, idx);
+  Fields fields = fieldsOf(program, idx);
+  string_view mnemonic = form.mnemonic;
+
+  // labels are statements of their own, so they end any sequence
+  auto following = [&](size_t offset, string_view followingMnemonic) {
+    size_t next = idx + offset;
+    return isMnemonic(program, next, followingMnemonic) &&
+                   !isSymbolic(program, next) &&
+                   !inSpan(spans, starts[next])
+               ? optional<Fields>(fieldsOf(program, next))
+               : optional<Fields>();
+  };
+
+  if (mnemonic == "mov" && fields.s == fields.d) {
+    savings.instructions++;
+    savings.bytes += 2;
+    return 1;
+  }
+
+  if ((mnemonic == "br" || mnemonic == "beq" || mnemonic == "bgt" ||
+       mnemonic == "j") &&
+      isSymbolic(program, idx) &&
+      program.symbolUses[program.values[idx]].addend == 0) {
+    uint32_t symbol = program.symbolUses[program.values[idx]].symbol;
+    for (size_t next = idx + 1;
+         next < program.ops.size() && program.ops[next] == Program::LABEL;
+         next++) {
+      if (program.values[next] == symbol) {
+        savings.instructions++;
+        savings.bytes += instructionSize(form);
+        return 1;
+      }
+    }
+  }
+
+  if (mnemonic == "inc" || mnemonic == "dec") {
+    size_t count = 1;
+    while (count < 4) {
+      optional<Fields> next = following(count, mnemonic);
+      if (!next || next->d != fields.d) break;
+      count++;
+    }
+    if (count == 4) {
+      replace(program, idx, opNamed(mnemonic == "inc" ? "inca" : "deca"),
+              fields, result);
+      savings.instructions += 3;
+      savings.bytes += 6;
+      return 4;
+    }
+  }
+
+  if (mnemonic == "ld" && form.operands[0].kind == OperandKind::IMMEDIATE &&
+      !isSymbolic(program, idx) && fields.value == 0) {
+    optional<Fields> add = following(1, "add");
+    if (add && add->s == fields.d) {  // adds zero
+      keep(program, idx, result);
+      savings.instructions++;
+      savings.bytes += 2;
+      return 2;
+    } else if (add && add->d == fields.d) {  // a copy
+      replace(program, idx, opNamed("mov"), Fields{add->s, fields.d, 0, 0, 0},
+              result);
+      savings.instructions++;
+      savings.bytes += 6;
+      return 2;
+    }
+  }
+
+  if (mnemonic == "shl" || mnemonic == "shr") {
+    optional<Fields> next = following(1, mnemonic);
+    // shifts are only merged while they stay below the width of a register
+    auto amount = [mnemonic](uint32_t value) {
+      long signedValue = static_cast<int32_t>(value);
+      return mnemonic == "shl" ? signedValue : -signedValue;
+    };
+    if (next && next->d == fields.d &&
+        amount(fields.value) + amount(next->value) < 32) {
+      long total = amount(fields.value) + amount(next->value);
+      Fields merged = fields;
+      merged.value = static_cast<uint32_t>(mnemonic == "shl" ? total : -total);
+      replace(program, idx, program.ops[idx], merged, result);
+      savings.instructions++;
+      savings.bytes += 2;
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+// statements from a run of labels to just before the next label or .pos
+struct Region {
+  size_t labels;  // the first label
+  size_t first;   // the first statement after the labels
+  size_t end;
+};
+
+// whether statement idx is known to be data - bytes from .rept and .incbin
+// may well be instructions
+bool isData(const Program& program, size_t idx) noexcept {
+  uint8_t op = program.ops[idx];
+  return op == Program::LONG || op == (Program::LONG | Program::SYMBOLIC) ||
+         op == Program::FILL;
+}
+// whether control never goes on to the next statement from statement idx
+bool stops(const Program& program, size_t idx) noexcept {
+  if (!isInstruction(program, idx)) return isData(program, idx);
+  string_view mnemonic = formOf(program, idx).mnemonic;
+  return mnemonic == "halt" || mnemonic == "br" || mnemonic == "j";
+}
+
+// Whether a region would act the same anywhere else: nothing in it depends on
+// where it is, and it doesn't fall through into whatever follows it. Unless
+// foldData is set, it has to be all instructions.
+bool isMovable(const Program& program, const Region& region, bool foldData) {
+  if (region.first == region.end || !stops(program, region.end - 1))
+    return false;
+  for (size_t idx = region.first; idx < region.end; idx++) {
+    uint8_t op = program.ops[idx];
+    if (op == Program::ALIGN) return false;
+    if (!foldData && !isInstruction(program, idx)) return false;
+    if (op == Program::BYTES)
+      for (const auto& use : program.chunks[program.values[idx]].uses)
+        if (use.isPCRel) return false;
+    if (isInstruction(program, idx) &&
+        (formOf(program, idx).value.pcRelative ||
+         formOf(program, idx).mnemonic == "gpc"))
+      return false;
+  }
+  return true;
+}
+
+// a value of statement idx that's the same wherever the statement is
+uint32_t valueOf(const Program& program, size_t idx) noexcept {
+  return (program.ops[idx] & Program::SYMBOLIC) != 0
+             ? program.symbolUses[program.values[idx]].symbol
+             : program.values[idx];
+}
+// what's added to the label statement idx uses, if any
+uint32_t addendOf(const Program& program, size_t idx) noexcept {
+  return (program.ops[idx] & Program::SYMBOLIC) != 0
+             ? program.symbolUses[program.values[idx]].addend
+             : 0;
+}
+
+size_t hashOf(const Program& program, const Region& region) {
+  size_t hash = region.end - region.first;
+  auto mix = [&hash](size_t value) { hash = hash * 1000003 ^ value; };
+  for (size_t idx = region.first; idx < region.end; idx++) {
+    mix(program.ops[idx]);
+    mix(program.registers[idx]);
+    if (program.ops[idx] == Program::BYTES) {
+      for (uint8_t byte : program.chunks[program.values[idx]].bytes) mix(byte);
+    } else if (program.ops[idx] == Program::FILL) {
+      mix(program.fills[program.values[idx]].count);
+      mix(program.fills[program.values[idx]].value);
+    } else if (program.ops[idx] == Program::INCLUDE) {
+      const Program::Include& include = program.includes[program.values[idx]];
+      for (uint64_t byte = 0; byte < include.size; byte++)
+        mix(include.data()[byte]);
+    } else {
+      mix(valueOf(program, idx));
+      mix(addendOf(program, idx));
+    }
+  }
+  return hash;
+}
+
+bool isIdentical(const Program& program, const Region& a, const Region& b) {
+  if (a.end - a.first != b.end - b.first) return false;
+  for (size_t offset = 0; offset < a.end - a.first; offset++) {
+    size_t x = a.first + offset, y = b.first + offset;
+    if (program.ops[x] != program.ops[y] ||
+        program.registers[x] != program.registers[y])
+      return false;
+    if (program.ops[x] == Program::BYTES) {
+      const Program::Chunk& chunkX = program.chunks[program.values[x]];
+      const Program::Chunk& chunkY = program.chunks[program.values[y]];
+      if (chunkX.bytes != chunkY.bytes ||
+          chunkX.uses.size() != chunkY.uses.size())
+        return false;
+      for (size_t use = 0; use < chunkX.uses.size(); use++)
+        if (chunkX.uses[use].useLocn != chunkY.uses[use].useLocn ||
+            chunkX.uses[use].labelName != chunkY.uses[use].labelName ||
+            chunkX.uses[use].addend != chunkY.uses[use].addend)
+          return false;
+    } else if (program.ops[x] == Program::FILL) {
+      const Program::Fill& fillX = program.fills[program.values[x]];
+      const Program::Fill& fillY = program.fills[program.values[y]];
+      if (fillX.count != fillY.count || fillX.value != fillY.value)
+        return false;
+    } else if (program.ops[x] == Program::INCLUDE) {
+      const Program::Include& includeX = program.includes[program.values[x]];
+      const Program::Include& includeY = program.includes[program.values[y]];
+      if (includeX.size != includeY.size ||
+          !equal(includeX.data(), includeX.data() + includeX.size,
+                 includeY.data()))
+        return false;
+    } else if (valueOf(program, x) != valueOf(program, y) ||
+               addendOf(program, x) != addendOf(program, y)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool overlapsSpan(const Spans& spans, uint64_t start, uint64_t end) noexcept {
+  auto after = upper_bound(
+      spans.begin(), spans.end(), static_cast<long>(start),
+      [](long p, const pair<long, long>& span) { return p < span.second; });
+  return after != spans.end() && after->first < static_cast<long>(end);
+}
+}  // namespace
+
+Savings peephole(Program& program) {
+  Savings savings{0, 0};
+  // Rewrites never make the program longer, or move what's in a span, so it
+  // only has to be laid out once - each statement keeps its first start.
+  vector<uint64_t> starts = layout(program);
+  Spans spans = spansOf(program, starts);
+
+  // Statements before done are finished with; those from idx on are still to
+  // be read. What a rewrite makes goes back just before idx, to be read again
+  // along with the statements before it that a longer sequence could start
+  // at, so rewrites that make others possible are followed up in one pass.
+  Program made(program.resource());  // only the statements
+  size_t done = 0;
+  for (size_t idx = 0; idx < program.ops.size();) {
+    size_t used = rewrite(program, idx, starts, spans, made, savings);
+    if (used == 0) {
+      moveStatement(program, starts, idx++, done++);
+      continue;
+    }
+    uint64_t start = starts[idx];
+    idx += used - made.ops.size();
+    for (size_t offset = 0; offset < made.ops.size(); offset++) {
+      program.ops[idx + offset] = made.ops[offset];
+      program.registers[idx + offset] = made.registers[offset];
+      program.values[idx + offset] = made.values[offset];
+      program.lines[idx + offset] = made.lines[offset];
+      starts[idx + offset] = start;
+    }
+    made.ops.clear();
+    made.registers.clear();
+    made.values.clear();
+    made.lines.clear();
+    for (size_t back = min(done, LONGEST_SEQUENCE - 1); back > 0; back--)
+      moveStatement(program, starts, --done, --idx);
+  }
+  program.ops.resize(done);
+  program.registers.resize(done);
+  program.values.resize(done);
+  program.lines.resize(done);
+  return savings;
+}
+
+Savings fold(Program& program, bool foldData) {
+  vector<uint64_t> starts = layout(program);
+  Spans spans = spansOf(program, starts);
+
+  // labels that branches go to have to stay in reach of them, and labels
+  // subtracted from each other have to stay apart
+  vector<bool> isBranchTarget(program.symbols.size(), false);
+  for (const Program::Difference& difference : program.differences)
+    isBranchTarget[difference.to] = isBranchTarget[difference.from] = true;
+  for (size_t idx = 0; idx < program.ops.size(); idx++)
+    if (isInstruction(program, idx) && isSymbolic(program, idx) &&
+        formOf(program, idx).value.pcRelative)
+      isBranchTarget[valueOf(program, idx)] = true;
+  unordered_map<string_view, size_t> symbols;
+  for (size_t symbol = 0; symbol < program.symbols.size(); symbol++)
+    symbols.emplace(program.symbols[symbol], symbol);
+  for (const Program::Chunk& chunk : program.chunks)
+    for (const auto& use : chunk.uses)
+      if (use.isPCRel && symbols.count(use.labelName) != 0)
+        isBranchTarget[symbols[use.labelName]] = true;
+
+  vector<Region> regions;
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    if (program.ops[idx] != Program::LABEL ||
+        (idx > 0 && program.ops[idx - 1] == Program::LABEL))
+      continue;
+    Region region{idx, idx, idx};
+    while (region.first < program.ops.size() &&
+           program.ops[region.first] == Program::LABEL)
+      region.first++;
+    region.end = region.first;
+    while (region.end < program.ops.size() &&
+           program.ops[region.end] != Program::LABEL &&
+           program.ops[region.end] != Program::POS)
+      region.end++;
+    regions.push_back(region);
+  }
+
+  // Keeps the first of each set of identical regions. The others go, as long
+  // as nothing can fall into them: what comes before them has to stop, so they
+  // can't be where the program starts either.
+  unordered_map<size_t, vector<size_t>> byHash;
+  vector<vector<size_t>> folded(program.ops.size());  // labels, by survivor
+  vector<bool> dropped(program.ops.size(), false);
+  Savings savings{0, 0};
+  for (const Region& region : regions) {
+    if (!isMovable(program, region, foldData)) continue;
+    vector<size_t>& candidates = byHash[hashOf(program, region)];
+    auto survivor = find_if(candidates.begin(), candidates.end(),
+                            [&](size_t candidate) {
+                              return isIdentical(program, regions[candidate],
+                                                 region);
+                            });
+    if (survivor == candidates.end()) {
+      candidates.push_back(static_cast<size_t>(&region - regions.data()));
+      continue;
+    }
+
+    size_t last = region.end - 1;
+    uint64_t start = starts[region.first];
+    uint64_t end = starts[last] + statementSize(program, last, starts[last]);
+    size_t before = region.labels;
+    while (before > 0 && program.ops[before - 1] == Program::ALIGN) before--;
+    bool isReached = false;
+    for (size_t idx = region.labels; idx < region.first; idx++)
+      isReached = isReached || isBranchTarget[program.values[idx]];
+    if (before == 0 || !stops(program, before - 1) || isReached ||
+        overlapsSpan(spans, start, end))
+      continue;
+
+    for (size_t idx = region.labels; idx < region.end; idx++) {
+      dropped[idx] = true;
+      if (program.ops[idx] == Program::LABEL)
+        folded[regions[*survivor].labels].push_back(idx);
+      else if (isInstruction(program, idx))
+        savings.instructions++;
+    }
+    savings.bytes += end - start;
+  }
+
+  Program result(program.resource());  // only the statements
+  for (size_t idx = 0; idx < program.ops.size(); idx++) {
+    for (size_t label : folded[idx]) keep(program, label, result);
+    if (!dropped[idx]) keep(program, idx, result);
+  }
+  program.ops = move(result.ops);
+  program.registers = move(result.registers);
+  program.values = move(result.values);
+  program.lines = move(result.lines);
+  return savings;
+}
+}  // namespace sm213assemble::optimizer
\ No newline at end of file
@@ -0,0 +1,65 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef SM213ASSEMBLE_OPTIMIZER_H_
+#define SM213ASSEMBLE_OPTIMIZER_H_
+
+#include "generator.h"
+
+namespace sm213assemble::optimizer {
+namespace {
+using sm213assemble::model::Program;
+}  // namespace
+
+// what a pass took out of the program
+struct Savings {
+  unsigned long instructions;
+  unsigned long bytes;
+};
+
+// Rewrites wasteful instruction sequences: four incs or decs of a register
+// become one inca or deca, mov rX, rX goes, ld $0 followed by an add of the
+// loaded register becomes a mov (or nothing), back to back shifts of a
+// register the same way are merged, and branches and jumps to the very next
+// statement go. Labels stay where they were bound. What one rewrite makes is
+// looked at again along with what's around it, so the program is only read
+// once, however rewrites lead on to each other.
+//
+// Literal PC-relative offsets (branches to a number, and gpc), offsets from
+// labels (label+4), and differences of labels (end-start) count bytes, so
+// nothing they span is touched. Other addresses given as numbers rather than
+// labels aren't adjusted.
+Savings peephole(Program& program);
+
+// Folds identical regions - statements from a label up to the next label or
+// .pos - into the first of them, binding the labels of the rest to it. Only
+// regions that would act the same anywhere are folded: they're all
+// instructions, none of their label uses or offsets are PC-relative, they end
+// in halt or a jump, and nothing before them falls through into them. Regions
+// that branches go to are kept, so the branches stay in reach, as are regions
+// with labels that are subtracted, and anything literal PC-relative offsets,
+// offsets from labels, or differences of labels span. Bytes from .rept and
+// .incbin might be instructions, so they're taken to fall through.
+//
+// With foldData, regions of .long, .space, and .fill that end in one of those
+// are folded too. The assembler can't tell a constant table from a variable,
+// so this is only safe if no folded data is ever written to - otherwise,
+// stores through one label show up in loads through the other.
+Savings fold(Program& program, bool foldData = false);
+}  // namespace sm213assemble::optimizer
+
+#endif  // SM213ASSEMBLE_OPTIMIZER_H_
\ No newline at end of file
@@ -0,0 +1,383 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "session.h"
+#include "io.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+namespace sm213assemble::model {
+namespace {
+using sm213assemble::io::IllegalCharacter;
+using sm213assemble::io::Token;
+using sm213assemble::io::tokenizeLine;
+using std::find;
+using std::istringstream;
+using std::make_unique;
+using std::max;
+using std::min;
+using std::min_element;
+using std::move;
+using std::move_backward;
+using std::numeric_limits;
+using std::sort;
+using std::unique;
+}  // namespace
+
+uint64_t Session::Line::end() const noexcept { return start + code.size(); }
+
+Session::Session() noexcept
+    : gapStart{0}, gapEnd{0}, longestLine{0}, longestFill{0}, size{0} {}
+Session::~Session() noexcept = default;
+
+vector<uint8_t> Session::image() const { return memory.read(size); }
+void Session::writeImage(ostream& out) const {
+  memory.write(out, size, false);
+}
+
+vector<Diagnostic> Session::diagnostics() const {
+  vector<Line*> sorted(failing.begin(), failing.end());
+  sort(sorted.begin(), sorted.end(),
+       [](const Line* a, const Line* b) { return a->key < b->key; });
+
+  vector<Diagnostic> result;
+  for (const Line* line : sorted) {
+    unsigned lineNo = static_cast<unsigned>(indexOf(*line) + 1);
+    if (line->parseError)
+      result.push_back(Diagnostic{lineNo, line->parseError->charNo,
+                                  line->parseError->message});
+    for (size_t idx = 0; idx < line->code.labels.size(); idx++)
+      if (winner(line->code.labels[idx]) != line)
+        result.push_back(Diagnostic{
+            lineNo, line->columns[idx],
+            "cannot reuse label '" + line->code.labels[idx] + "'."});
+    for (const Diagnostic& error : line->fixupErrors)
+      result.push_back(Diagnostic{lineNo, error.charNo, error.message});
+  }
+  return result;
+}
+
+void Session::edit(size_t first, size_t count, const vector<string>& text) {
+  first = min(first, lineCount());
+  count = min(count, lineCount() - first);
+
+  vector<Region> regions;                            // of the image to redo
+  unordered_map<string, optional<uint64_t>> moved;  // labels, and old address
+  unordered_map<Line*, bool> pending;  // lines to place, and if to resolve
+  auto touch = [this, &moved](const string& labelName) {
+    if (moved.find(labelName) == moved.end())
+      moved.emplace(labelName, address(labelName));
+  };
+
+  // labels just before the edit can be bound by the first line it changes
+  for (size_t idx = first; idx > 0 && !movesEnd(lineAt(idx - 1)); idx--)
+    for (const string& labelName : lineAt(idx - 1).code.labels)
+      touch(labelName);
+
+  // take out the old lines
+  for (size_t idx = first; idx < first + count; idx++) {
+    Line& line = lineAt(idx);
+    unplace(line, regions);
+    for (const string& labelName : line.code.labels) {
+      touch(labelName);
+      vector<Line*>& binders = symbols[labelName].binders;
+      binders.erase(find(binders.begin(), binders.end(), &line));
+    }
+    for (const LabelUse& use : line.code.uses) {
+      touch(use.labelName);
+      symbols[use.labelName].users.erase(&line);
+    }
+    failing.erase(&line);
+  }
+
+  // tokenize and encode the new ones
+  openGap(first, 0);
+  for (size_t idx = gapEnd; idx < gapEnd + count; idx++) lines[idx].reset();
+  gapEnd += count;
+  openGap(first, text.size());
+  for (const string& lineText : text) {
+    auto line = make_unique<Line>();
+    line->pcRelative = false;
+    line->before = line->start = 0;
+    line->isPlaced = false;
+
+    istringstream in(lineText);
+    vector<Token> tokens;
+    try {
+      tokenizeLine(in, 1, tokens);
+      line->code = assembleLine(tokens);
+    } catch (const IllegalCharacter& e) {
+      line->parseError = Diagnostic{0, e.column(), e.message()};
+    } catch (const ParseError& e) {
+      line->parseError = Diagnostic{0, e.column(), e.message()};
+      line->code = LineCode();
+    }
+    for (const string& labelName : line->code.labels)
+      for (const Token& token : tokens)
+        if (token.value == labelName + ":")
+          line->columns.push_back(token.charNo);
+    for (const LabelUse& use : line->code.uses)
+      line->pcRelative = line->pcRelative || use.isPCRel;
+    longestLine = max(longestLine, line->code.bytes.size());
+    longestFill = max(longestFill, line->code.fillCount);
+    lines[gapStart++] = move(line);
+  }
+  keyLines(first, text.size());
+
+  for (size_t idx = first; idx < first + text.size(); idx++) {
+    Line& line = lineAt(idx);
+    for (const string& labelName : line.code.labels) {
+      touch(labelName);
+      symbols[labelName].binders.push_back(&line);
+    }
+    for (const LabelUse& use : line.code.uses)
+      symbols[use.labelName].users.insert(&line);
+    pending[&line] = true;
+  }
+
+  // lay out everything from the edit on, until lines stop moving
+  for (size_t idx = first; idx < lineCount(); idx++) {
+    Line& line = lineAt(idx);
+    bool isNew = idx < first + text.size();
+    uint64_t before = idx == 0 ? 0 : lineAt(idx - 1).end();
+    if (!isNew && before == line.before) break;
+
+    uint64_t start = before;
+    if (line.code.pos)
+      start = *line.code.pos;
+    else if (line.code.align)
+      start = (before + *line.code.align - 1) / *line.code.align *
+              *line.code.align;
+    if (!isNew) {
+      for (const string& labelName : line.code.labels) touch(labelName);
+      if (start != line.start) {
+        unplace(line, regions);
+        pending.emplace(&line, line.pcRelative);
+      }
+    }
+    line.before = before;
+    line.start = start;
+  }
+
+  // label uses only need resolving again if their label moved
+  for (const auto& entry : moved) {
+    auto found = symbols.find(entry.first);
+    if (found == symbols.end()) continue;
+    if (address(entry.first) != entry.second)
+      for (Line* user : found->second.users) pending[user] = true;
+    for (Line* binder : found->second.binders) updateFailing(*binder);
+    if (found->second.binders.empty() && found->second.users.empty())
+      symbols.erase(found);
+  }
+
+  for (const auto& entry : pending) {
+    Line& line = *entry.first;
+    unplace(line, regions);
+    if (entry.second || line.bytes.size() != line.code.bytes.size())
+      resolveLine(line);
+    place(line, regions);
+  }
+  rebuild(regions);
+}
+
+size_t Session::lineCount() const noexcept {
+  return lines.size() - (gapEnd - gapStart);
+}
+Session::Line& Session::lineAt(size_t idx) const noexcept {
+  return *lines[idx < gapStart ? idx : idx + (gapEnd - gapStart)];
+}
+size_t Session::indexOf(const Line& line) const noexcept {
+  size_t low = 0, high = lineCount();
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (lineAt(mid).key < line.key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+void Session::openGap(size_t idx, size_t count) {
+  if (idx < gapStart) {
+    move_backward(lines.begin() + static_cast<long>(idx),
+                  lines.begin() + static_cast<long>(gapStart),
+                  lines.begin() + static_cast<long>(gapEnd));
+    gapEnd -= gapStart - idx;
+    gapStart = idx;
+  } else if (idx > gapStart) {
+    move(lines.begin() + static_cast<long>(gapEnd),
+         lines.begin() + static_cast<long>(gapEnd + idx - gapStart),
+         lines.begin() + static_cast<long>(gapStart));
+    gapEnd += idx - gapStart;
+    gapStart = idx;
+  }
+  if (gapEnd - gapStart >= count) return;
+
+  size_t after = lines.size() - gapEnd;
+  lines.resize(max(2 * lines.size(), lineCount() + count));
+  move_backward(lines.begin() + static_cast<long>(gapEnd),
+                lines.begin() + static_cast<long>(gapEnd + after), lines.end());
+  gapEnd = lines.size() - after;
+}
+void Session::keyLines(size_t first, size_t count) {
+  // Widens the lines keyed around the new ones until there's room for them to
+  // be spaced further apart than there are of them, so giving out keys again
+  // gets rarer the more there are to give out.
+  size_t from = first, to = first + count;
+  for (size_t grow = 1;; grow *= 2) {
+    uint64_t low = from == 0 ? 0 : lineAt(from - 1).key;
+    uint64_t high =
+        to == lineCount() ? numeric_limits<uint64_t>::max() : lineAt(to).key;
+    uint64_t keyed = to - from;
+    uint64_t step = (high - low) / (keyed + 1);
+    if (step > keyed || (from == 0 && to == lineCount())) {
+      for (size_t idx = from; idx < to; idx++)
+        lineAt(idx).key = low + step * (idx - from + 1);
+      return;
+    }
+    from = from > grow ? from - grow : 0;
+    to = min(to + grow, lineCount());
+  }
+}
+
+Session::Line* Session::winner(const string& labelName) const noexcept {
+  auto found = symbols.find(labelName);
+  if (found == symbols.end() || found->second.binders.empty()) return nullptr;
+  return *min_element(
+      found->second.binders.begin(), found->second.binders.end(),
+      [](const Line* a, const Line* b) { return a->key < b->key; });
+}
+optional<uint64_t> Session::address(const string& labelName) const noexcept {
+  Line* line = winner(labelName);
+  if (line == nullptr) return {};
+  // labels on lines of their own are bound where the next line's would be
+  size_t idx = indexOf(*line);
+  while (!movesEnd(lineAt(idx)) && idx + 1 < lineCount()) idx++;
+  return lineAt(idx).code.alignsLabels ? lineAt(idx).start : line->before;
+}
+
+bool Session::movesEnd(const Line& line) noexcept {
+  return line.code.size() != 0 || line.code.pos || line.code.align;
+}
+void Session::place(Line& line, vector<Region>& regions) {
+  if (line.isPlaced) return;
+  if (!line.code.bytes.empty()) placed.emplace(line.start, &line);
+  if (line.code.fillCount != 0) filled.emplace(line.start, &line);
+  if (movesEnd(line)) ends.insert(line.end());
+  regions.push_back(Region(line.start, line.end()));
+  line.isPlaced = true;
+}
+void Session::unplace(Line& line, vector<Region>& regions) {
+  if (!line.isPlaced) return;
+  for (multimap<uint64_t, Line*>* byStart : {&placed, &filled}) {
+    auto range = byStart->equal_range(line.start);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+      if (iter->second == &line) {
+        byStart->erase(iter);
+        break;
+      }
+    }
+  }
+  if (movesEnd(line)) ends.erase(ends.find(line.end()));
+  regions.push_back(Region(line.start, line.end()));
+  line.isPlaced = false;
+}
+
+void Session::resolveLine(Line& line) {
+  line.bytes = line.code.bytes;
+  line.fixupErrors.clear();
+  if (line.end() > MEMORY_SIZE) {
+    line.fixupErrors.push_back(Diagnostic{0, 1, "line is past end of memory."});
+    line.bytes.clear();
+  }
+
+  for (const LabelUse& use : line.code.uses) {
+    if (line.bytes.empty()) break;
+    optional<uint64_t> target = address(use.labelName);
+    if (!target || *target >= MEMORY_SIZE) {
+      line.fixupErrors.push_back(Diagnostic{
+          0, use.labelChar, "unbound label '" + use.labelName + "'."});
+      continue;
+    }
+
+    LabelUse placedUse = use;
+    placedUse.useLocn = static_cast<uint32_t>(line.start + use.useLocn);
+    try {
+      resolve(placedUse, static_cast<uint32_t>(*target),
+              &line.bytes[use.useLocn]);
+    } catch (const ParseError& e) {
+      line.fixupErrors.push_back(Diagnostic{0, e.column(), e.message()});
+    }
+  }
+  if (line.bytes.empty()) line.bytes.resize(line.code.bytes.size());
+  updateFailing(line);
+}
+
+void Session::updateFailing(Line& line) {
+  bool fails = line.parseError || !line.fixupErrors.empty();
+  for (const string& labelName : line.code.labels)
+    fails = fails || winner(labelName) != &line;
+  if (fails)
+    failing.insert(&line);
+  else
+    failing.erase(&line);
+}
+
+void Session::rebuild(vector<Region>& regions) {
+  uint64_t newSize = ends.empty() ? 0 : min(*ends.rbegin(), MEMORY_SIZE);
+  if (newSize < size)  // so the image reads as zeros if it grows back
+    memory.fill(newSize, 0, size - newSize);
+  size = newSize;
+
+  // redo each merged region by laying down the lines in it, in order
+  sort(regions.begin(), regions.end());
+  for (size_t idx = 0; idx < regions.size(); idx++) {
+    uint64_t start = regions[idx].first, end = regions[idx].second;
+    while (idx + 1 < regions.size() && regions[idx + 1].first <= end)
+      end = max(end, regions[++idx].second);
+    end = min(end, size);
+    if (start >= end) continue;
+
+    memory.fill(start, 0, end - start);
+    vector<Line*> overlapping;
+    for (auto iter = placed.lower_bound(
+             start > longestLine ? start - longestLine : 0);
+         iter != placed.end() && iter->first < end; ++iter)
+      if (iter->second->end() > start) overlapping.push_back(iter->second);
+    for (auto iter = filled.lower_bound(
+             start > longestFill ? start - longestFill : 0);
+         iter != filled.end() && iter->first < end; ++iter)
+      if (iter->second->end() > start) overlapping.push_back(iter->second);
+    sort(overlapping.begin(), overlapping.end(),
+         [](const Line* a, const Line* b) { return a->key < b->key; });
+    overlapping.erase(unique(overlapping.begin(), overlapping.end()),
+                      overlapping.end());
+    for (const Line* line : overlapping) {
+      uint64_t fillStart = line->start + line->bytes.size();
+      uint64_t from = max(start, line->start);
+      uint64_t to = min(end, fillStart);
+      if (from < to)
+        memory.put(from, line->bytes.data() + (from - line->start), to - from);
+      from = max(start, fillStart);
+      to = min(end, line->end());
+      if (from < to) memory.fill(from, line->code.fillValue, to - from);
+    }
+  }
+}
+}  // namespace sm213assemble::model
\ No newline at end of file
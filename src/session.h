@@ -0,0 +1,139 @@
+// Copyright 2018 Justin Hu
+//
+// This file is part of the SM213 assembler.
+//
+// The SM213 assembler is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// The SM213 assembler is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+// Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the SM213 assembler.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef SM213ASSEMBLE_MODEL_SESSION_H_
+#define SM213ASSEMBLE_MODEL_SESSION_H_
+
+#include "generator.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace sm213assemble::model {
+namespace {
+using std::multimap;
+using std::multiset;
+using std::optional;
+using std::ostream;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+}  // namespace
+
+struct Diagnostic {
+  unsigned lineNo;
+  unsigned charNo;
+  string message;
+};
+
+// Keeps a program assembled while it's edited, for editors that reassemble on
+// every change. Only edited lines are tokenized and encoded again. Later lines
+// only move if an edit changed how much comes before them, and label uses are
+// only resolved again if their label moved or, for branches, they did. Since
+// every line stands alone, .rept blocks can't be used, and .equ constants only
+// count on their own line. Lines are kept in order by keys that are only
+// given out again when an edit runs out of room between its neighbours, and the
+// image is kept in pages, so an edit costs what it changes, not what's around
+// it.
+class Session {
+ public:
+  Session() noexcept;
+  Session(const Session&) = delete;
+  ~Session() noexcept;
+
+  Session& operator=(const Session&) = delete;
+
+  // replaces count lines starting at line first (counted from zero) with lines
+  void edit(size_t first, size_t count, const vector<string>& lines);
+
+  // the whole image, put together from its pages
+  vector<uint8_t> image() const;
+  // writes the image page by page, never holding it whole
+  void writeImage(ostream& out) const;
+  // every error in the program, in line order
+  vector<Diagnostic> diagnostics() const;
+
+ private:
+  struct Line {
+    uint64_t key;              // bigger for later lines
+    LineCode code;             // with placeholders for label uses
+    vector<unsigned> columns;  // of each of code.labels
+    vector<uint8_t> bytes;     // code.bytes with label uses filled in
+    bool pcRelative;           // whether any label use depends on start
+    optional<Diagnostic> parseError;
+    vector<Diagnostic> fixupErrors;
+    uint64_t before;  // where the previous line ended - labels bind here
+    uint64_t start;   // where bytes go, and labels if code.alignsLabels
+    bool isPlaced;
+
+    uint64_t end() const noexcept;
+  };
+  struct Symbol {
+    vector<Line*> binders;  // the earliest one wins
+    unordered_set<Line*> users;
+  };
+  typedef pair<uint64_t, uint64_t> Region;
+
+  size_t lineCount() const noexcept;
+  Line& lineAt(size_t idx) const noexcept;  // counted from zero
+  size_t indexOf(const Line&) const noexcept;
+  // makes the gap start before line idx, and hold at least count lines
+  void openGap(size_t idx, size_t count);
+  // keys count lines from line first, giving out the keys around them again
+  // if they don't fit between their neighbours
+  void keyLines(size_t first, size_t count);
+
+  Line* winner(const string& labelName) const noexcept;
+  optional<uint64_t> address(const string& labelName) const noexcept;
+  // whether the image has to reach the end of line
+  static bool movesEnd(const Line& line) noexcept;
+  void place(Line&, vector<Region>& regions);
+  void unplace(Line&, vector<Region>& regions);
+  void resolveLine(Line&);
+  void updateFailing(Line&);
+  void rebuild(vector<Region>& regions);
+
+  // in order, but for a gap at the last edit, so edits near each other only
+  // move the lines between them
+  vector<unique_ptr<Line>> lines;
+  size_t gapStart;
+  size_t gapEnd;
+  unordered_map<string, Symbol> symbols;
+  multimap<uint64_t, Line*> placed;  // lines with bytes, by start
+  multimap<uint64_t, Line*> filled;  // lines with fills, by start
+  multiset<uint64_t> ends;           // of lines for which movesEnd is true
+  size_t longestLine;
+  uint64_t longestFill;
+  unordered_set<Line*> failing;
+  PagedMemory memory;
+  uint64_t size;  // of the image
+};
+}  // namespace sm213assemble::model
+
+#endif  // SM213ASSEMBLE_MODEL_SESSION_H_
\ No newline at end of file